@@ -1,9 +1,35 @@
 #define BM_IMPLEMENTATION
 #include "bm.h"
 
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BASM_JOBS_CAPACITY 256
+// Part of every cache key, bump it whenever the same source starts translating differently.
+#define BASM_VERSION 2
+
 static Bm bm = {0};
 static BasmContext lt = {0};
 
+typedef struct {
+	Bm bm;
+	BasmContext basm;
+	BmObject object;
+} ObjectUnit;
+
+static char** object_inputs = NULL;
+static size_t object_inputs_size = 0;
+static atomic_size_t object_inputs_next = 0;
+
+static const char* cache_dir = NULL;
+static atomic_size_t cache_hits = 0;
+static atomic_size_t cache_misses = 0;
+
 static char* shift(int* argc, char*** argv) {
 	if (*argc == 0) {
 		return NULL;
@@ -15,17 +41,306 @@ static char* shift(int* argc, char*** argv) {
 }
 
 static void usage(FILE* stream, const char* program) {
-	fprintf(stream, "Usage: %s <input.basm> <output.bm>\n", program);
+	fprintf(stream, "Usage: %s [--cache <dir>] <input.basm> <output.bm>\n", program);
+	fprintf(stream, "       %s [--cache <dir>] -c [-j <jobs>] <input.basm>...\n", program);
+}
+
+// `foo.basm` becomes `foo.bmo`, anything else gets `.bmo` appended.
+static char* object_path(const char* input_file_path) {
+	size_t n = strlen(input_file_path);
+	size_t extension = strlen(".basm");
+	if (n >= extension && strcmp(input_file_path + n - extension, ".basm") == 0) {
+		n -= extension;
+	}
+
+	char* result = malloc(n + sizeof(".bmo"));
+	if (result == NULL) {
+		fprintf(stderr, "ERROR: Could not allocate memory for path: %s\n", strerror(errno));
+		exit(1);
+	}
+	memcpy(result, input_file_path, n);
+	memcpy(result + n, ".bmo", sizeof(".bmo"));
+	return result;
+}
+
+// Everything the output depends on: the versions of the assembler and the file formats, what is
+// being produced and the source. Entries are named by its hash and a hit compares it in full, so
+// a hash collision is a miss rather than a wrong output.
+static StringView cache_material(StringView source, const char* kind) {
+	uint32_t versions[] = {BASM_VERSION, BM_FILE_VERSION, BM_OBJECT_VERSION};
+	size_t kind_size = strlen(kind) + 1;
+	size_t n = sizeof(versions) + kind_size + source.count;
+	char* data = malloc(n);
+	if (data == NULL) {
+		fprintf(stderr, "ERROR: Could not allocate memory for cache key: %s\n", strerror(errno));
+		exit(1);
+	}
+	memcpy(data, versions, sizeof(versions));
+	memcpy(data + sizeof(versions), kind, kind_size);
+	memcpy(data + sizeof(versions) + kind_size, source.data, source.count);
+	return (StringView){.count = n, .data = data};
+}
+
+static char* path_join(const char* dir_path, const char* name) {
+	size_t n = strlen(dir_path) + strlen(name) + 2;
+	char* result = malloc(n);
+	if (result == NULL) {
+		fprintf(stderr, "ERROR: Could not allocate memory for path: %s\n", strerror(errno));
+		exit(1);
+	}
+	snprintf(result, n, "%s/%s", dir_path, name);
+	return result;
+}
+
+// Every entry is a directory holding the `material` it was produced from and the `output`. Both
+// are read-only and never change once the directory is in place.
+static char* cache_entry_path(StringView material, const char* kind) {
+	char name[64];
+	snprintf(name, sizeof(name), "%016" PRIx64 ".%s",
+			fnv1a(FNV1A_OFFSET_BASIS, material.data, material.count), kind);
+	return path_join(cache_dir, name);
+}
+
+static bool write_file(const char* file_path, StringView data) {
+	FILE* f = fopen(file_path, "wb");
+	if (f == NULL) {
+		return false;
+	}
+	bool ok = fwrite(data.data, 1, data.count, f) == data.count;
+	return fclose(f) == 0 && ok;
+}
+
+static bool file_equals(const char* file_path, StringView data) {
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	bool equal = fstat(fd, &st) == 0 && (uint64_t)st.st_size == data.count;
+	if (equal && data.count > 0) {
+		void* mapped = mmap(NULL, data.count, PROT_READ, MAP_PRIVATE, fd, 0);
+		equal = mapped != MAP_FAILED && memcmp(mapped, data.data, data.count) == 0;
+		if (mapped != MAP_FAILED) {
+			munmap(mapped, data.count);
+		}
+	}
+	close(fd);
+	return equal;
+}
+
+// Creates `dst_file_path` like any other output, so it gets the usual mode. Where the file system
+// supports it the data is shared with `src_file_path` as a reflink, which is copied on write.
+static bool copy_file(const char* src_file_path, const char* dst_file_path) {
+	int src = open(src_file_path, O_RDONLY);
+	if (src < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(src, &st) < 0) {
+		close(src);
+		return false;
+	}
+	FILE* dst = fopen(dst_file_path, "wb");
+	if (dst == NULL) {
+		close(src);
+		return false;
+	}
+
+	bool ok = true;
+	if (st.st_size > 0 && ioctl(fileno(dst), FICLONE, src) < 0) {
+		void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src, 0);
+		if (data == MAP_FAILED) {
+			ok = false;
+		} else {
+			ok = fwrite(data, 1, st.st_size, dst) == (size_t)st.st_size;
+			munmap(data, st.st_size);
+		}
+	}
+	close(src);
+	ok = fclose(dst) == 0 && ok;
+	return ok;
+}
+
+// On a hit the cached output is copied to `output_file_path` under a temporary name and renamed
+// over it. Only the entry itself is read-only, the output gets the same mode as on a miss.
+static bool cache_fetch(StringView material, const char* kind, const char* output_file_path) {
+	char* entry = cache_entry_path(material, kind);
+	char* material_path = path_join(entry, "material");
+	char* output_path = path_join(entry, "output");
+
+	bool hit = file_equals(material_path, material);
+	if (hit) {
+		char* temporary_path = bm_temporary_path(output_file_path);
+		hit = copy_file(output_path, temporary_path);
+		if (!hit || rename(temporary_path, output_file_path) < 0) {
+			unlink(temporary_path);
+			hit = false;
+		}
+		free(temporary_path);
+	}
+	free(output_path);
+	free(material_path);
+	free(entry);
+
+	atomic_fetch_add(hit ? &cache_hits : &cache_misses, 1);
+	return hit;
+}
+
+// Fills a temporary directory and renames it into place, so concurrent runs never see partial
+// entries. The rename fails if the entry already exists, and the one there is kept.
+static void cache_store(StringView material, const char* kind, const char* output_file_path) {
+	char* entry = cache_entry_path(material, kind);
+	char* temporary = bm_temporary_path(entry);
+	char* material_path = path_join(temporary, "material");
+	char* output_path = path_join(temporary, "output");
+
+	if (mkdir(temporary, 0755) == 0) {
+		bool ok = write_file(material_path, material) &&
+				copy_file(output_file_path, output_path) && chmod(material_path, 0444) == 0 &&
+				chmod(output_path, 0444) == 0;
+		if (!ok || rename(temporary, entry) < 0) {
+			unlink(material_path);
+			unlink(output_path);
+			rmdir(temporary);
+		}
+	}
+	free(output_path);
+	free(material_path);
+	free(temporary);
+	free(entry);
+}
+
+// Worker of `basm -c`. Inputs are independent, so each worker claims the next one until none are
+// left, reusing its own unit (and the memory mapping of its `Bm`) across files.
+static void* assemble_objects(void* arg) {
+	(void)arg;
+	ObjectUnit* unit = calloc(1, sizeof(*unit));
+	if (unit == NULL) {
+		fprintf(stderr, "ERROR: Could not allocate memory for assembler: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (;;) {
+		size_t i = atomic_fetch_add(&object_inputs_next, 1);
+		if (i >= object_inputs_size) {
+			break;
+		}
+
+		uint8_t* memory = unit->bm.memory;
+		memset(unit, 0, sizeof(*unit));
+		unit->bm.memory = memory;
+		unit->basm.file_path = object_inputs[i];
+
+		StringView source = slurp_file(object_inputs[i]);
+		char* output_file_path = object_path(object_inputs[i]);
+		StringView material = {0};
+		bool hit = false;
+		if (cache_dir != NULL) {
+			material = cache_material(source, "bmo");
+			hit = cache_fetch(material, "bmo", output_file_path);
+		}
+
+		if (!hit) {
+			basm_translate_object(source, &unit->bm, &unit->basm, &unit->object);
+			bm_save_object_to_file(&unit->bm, &unit->object, output_file_path);
+			if (cache_dir != NULL) {
+				cache_store(material, "bmo", output_file_path);
+			}
+		}
+		free((char*)material.data);
+		free(output_file_path);
+		free((char*)source.data);
+	}
+
+	if (unit->bm.memory != NULL) {
+		munmap(unit->bm.memory, BM_MEMORY_CAPACITY);
+	}
+	free(unit);
+	return NULL;
+}
+
+static void assemble_objects_in_parallel(char** inputs, size_t inputs_size, long jobs) {
+	object_inputs = inputs;
+	object_inputs_size = inputs_size;
+
+	if (jobs <= 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (jobs > BASM_JOBS_CAPACITY) {
+		jobs = BASM_JOBS_CAPACITY;
+	}
+	if ((size_t)jobs > inputs_size) {
+		jobs = (long)inputs_size;
+	}
+
+	pthread_t threads[BASM_JOBS_CAPACITY];
+	for (long i = 0; i < jobs; i++) {
+		int error = pthread_create(&threads[i], NULL, assemble_objects, NULL);
+		if (error != 0) {
+			fprintf(stderr, "ERROR: Could not start assembler thread: %s\n", strerror(error));
+			exit(1);
+		}
+	}
+	for (long i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+static void print_cache_stats(void) {
+	if (cache_dir != NULL) {
+		fprintf(stderr, "Cache: %zu hits, %zu misses\n", atomic_load(&cache_hits),
+				atomic_load(&cache_misses));
+	}
 }
 
 int main(int argc, char** argv) {
 	char* program = shift(&argc, &argv);
 
+	if (argc > 0 && strcmp(argv[0], "--cache") == 0) {
+		shift(&argc, &argv);
+		if (argc == 0) {
+			usage(stderr, program);
+			fprintf(stderr, "ERROR: no argument provided for flag `--cache`\n");
+			exit(1);
+		}
+		cache_dir = shift(&argc, &argv);
+		if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "ERROR: Could not create cache directory `%s`: %s\n", cache_dir,
+					strerror(errno));
+			exit(1);
+		}
+	}
+
 	if (argc == 0) {
 		usage(stderr, program);
 		fprintf(stderr, "ERROR: expected input\n");
 		exit(1);
 	}
+
+	if (strcmp(argv[0], "-c") == 0) {
+		shift(&argc, &argv);
+		long jobs = 0;
+		if (argc > 0 && strcmp(argv[0], "-j") == 0) {
+			shift(&argc, &argv);
+			if (argc == 0) {
+				usage(stderr, program);
+				fprintf(stderr, "ERROR: no argument provided for flag `-j`\n");
+				exit(1);
+			}
+			jobs = atol(shift(&argc, &argv));
+		}
+
+		if (argc == 0) {
+			usage(stderr, program);
+			fprintf(stderr, "ERROR: expected input\n");
+			exit(1);
+		}
+
+		assemble_objects_in_parallel(argv, (size_t)argc, jobs);
+		print_cache_stats();
+		return 0;
+	}
+
 	const char* input_file_path = shift(&argc, &argv);
 
 	if (argc == 0) {
@@ -36,7 +351,21 @@ int main(int argc, char** argv) {
 	const char* output_file_path = shift(&argc, &argv);
 
 	StringView source = slurp_file(input_file_path);
+	StringView material = {0};
+	if (cache_dir != NULL) {
+		material = cache_material(source, "bm");
+		if (cache_fetch(material, "bm", output_file_path)) {
+			print_cache_stats();
+			return 0;
+		}
+	}
+
+	lt.file_path = input_file_path;
 	bm_translate_source(source, &bm, &lt);
 
 	bm_save_program_to_file(&bm, output_file_path);
+	if (cache_dir != NULL) {
+		cache_store(material, "bm", output_file_path);
+		print_cache_stats();
+	}
 }
@@ -11,12 +11,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define BM_STACK_CAPACITY 1024
 #define BM_PROGRAM_CAPACITY 1024
+#define BM_MEMORY_CAPACITY (64 * 1024 * 1024)
 #define BM_EXECUTION_LIMIT 69
+#define BM_FILE_MAGIC 0x4D42
+#define BM_FILE_VERSION 2
+#define BM_NATIVES_CAPACITY 256
+#define BM_NATIVE_NAME_CAPACITY 32
+#define BM_OBJECT_MAGIC 0x4F42
+#define BM_OBJECT_VERSION 1
+#define BM_SYMBOLS_CAPACITY 1024
+#define BM_SYMBOL_NAME_CAPACITY 64
+#define BM_RECORDER_CAPACITY (1 << 20)
+#define BM_RECORD_MAGIC 0x5242
+#define BM_RECORD_VERSION 3
 #define LABEL_CAPACITY 1024
 #define DEFERRED_OPERANDS_CAPACITY 1024
+#define BM_TRACES_CAPACITY 64
+#define BM_TRACE_CAPACITY 128
+#define BM_TRACE_THRESHOLD 64
+#define FNV1A_OFFSET_BASIS UINT64_C(0xcbf29ce484222325)
 #define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
 
 #define TRAPS_X \
@@ -26,7 +50,8 @@
 	X(illegal_inst) \
 	X(div_by_zero) \
 	X(illegal_inst_access) \
-	X(illegal_operand)
+	X(illegal_operand) \
+	X(illegal_memory_access)
 
 typedef enum {
 #define X(name) trap_##name,
@@ -49,7 +74,24 @@ typedef int64_t Word;
 	X(eq) \
 	X(halt) \
 	X(print_debug) \
-	X(dup)
+	X(dup) \
+	X(read8) \
+	X(read16) \
+	X(read32) \
+	X(read64) \
+	X(write8) \
+	X(write16) \
+	X(write32) \
+	X(write64) \
+	X(vplus) \
+	X(vmult) \
+	X(veq) \
+	X(vsum) \
+	X(native) \
+	X(mvplus) \
+	X(mvmult) \
+	X(mveq) \
+	X(mvsum)
 
 typedef enum {
 #define X(name) inst_type_##name,
@@ -63,6 +105,72 @@ typedef struct {
 } Inst;
 
 typedef struct {
+	Inst inst;
+	// Address of `inst` in the program, where a side exit resumes interpretation.
+	Word ip;
+	// Direction a `jump_if` took while recording; the other one leaves the trace.
+	bool taken;
+} BmTraceOp;
+
+// A linear recording of one iteration of a hot loop, starting and ending at `start`.
+typedef struct {
+	Word start;
+	BmTraceOp ops[BM_TRACE_CAPACITY];
+	size_t ops_size;
+	// Stack depth the trace reads below its entry point and the most it grows above it. Checking
+	// both once per iteration lets the ops skip the per-instruction stack checks.
+	size_t stack_needed;
+	size_t stack_growth;
+} BmTrace;
+
+// Execution record of `bme --trace`. The VM thread only appends to `data`, a single-producer
+// single-consumer ring, and another thread drains it to a file with `bm_recorder_drain`.
+//
+// The record is a sequence of (run, step) pairs of varints. `run` instructions executed one after
+// another and `step` tells how the last of them continued:
+// - `step == 0` ends the record. It is followed by the `Trap` the run stopped with and by 1 if that
+//   trap was returned by a native, with the native's stack effect, or by 0 otherwise.
+// - `step == 1` means the last instruction was a `native`, followed by its stack effect, see
+//   `bm_record_native`. Replay applies the effect instead of calling the native again.
+// - Any other odd `step` is a trace run that followed the `run` instructions: `step >> 1` more
+//   instructions executed by `bm_execute_trace`, followed by the `ip` it left at, zigzag encoded.
+//   A trace has no natives, so replay can execute them again without checking each one.
+// - Otherwise the last instruction moved `ip` to `ip + 1 + delta`, and `step` is the zigzag encoded
+//   `delta` shifted left by one.
+typedef struct {
+	uint8_t data[BM_RECORDER_CAPACITY];
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_bool done;
+	uint64_t run;
+	// The stack right before the current `native` call, to find the words it changed.
+	Word stack[BM_STACK_CAPACITY];
+	size_t stack_size;
+	bool native_called;
+} BmRecorder;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t program_size;
+	// `bm_program_hash` of the program the record was taken from.
+	uint64_t program_hash;
+} BmRecordHeader;
+
+typedef struct Bm Bm;
+
+// A host function callable with `native`. It operates on the operand stack of `bm` directly and
+// returns `trap_ok` to let execution continue at the next instruction. It may read `bm->memory`
+// but must not write it: an execution record only keeps the stack effect of a native. While
+// recording, memory is mapped read-only for the duration of the call.
+typedef Trap (*BmNative)(Bm* bm);
+
+typedef struct {
+	const char* name;
+	BmNative native;
+} BmNativeDef;
+
+struct Bm {
 	Word stack[BM_STACK_CAPACITY];
 	size_t stack_size;
 
@@ -70,8 +178,44 @@ typedef struct {
 	Word program_size;
 	Word ip;
 
+	// Mapped lazily on first access, see `bm_memory`.
+	uint8_t* memory;
+	// Number of bytes at the start of `memory` initialized by the program's data section.
+	Word memory_size;
+
+	// Names referenced by the program, indexed by the operand of `native`. They are resolved to
+	// `natives` once by `bm_bind_natives`, so calls never look anything up by name.
+	char native_names[BM_NATIVES_CAPACITY][BM_NATIVE_NAME_CAPACITY];
+	BmNative natives[BM_NATIVES_CAPACITY];
+	size_t natives_size;
+
+	// Number of instructions completed by `bm_execute_program`.
+	uint64_t executed;
+
+	// Tracing tier, see `bm_execute_program`.
+	bool traces_disabled;
+	uint32_t branch_counts[BM_PROGRAM_CAPACITY];
+	// 0 if no trace starts at the address, the trace index + 1 if one does, -1 if recording one
+	// failed and should not be retried.
+	int trace_of[BM_PROGRAM_CAPACITY];
+	BmTrace traces[BM_TRACES_CAPACITY];
+	size_t traces_size;
+	// Trace being recorded, always `&traces[traces_size]` while set.
+	BmTrace* recording;
+
+	// Set by `bme --trace`. Interpreted instructions are recorded one by one, trace runs as a whole.
+	BmRecorder* recorder;
+
 	bool halt;
-} Bm;
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t program_size;
+	uint64_t natives_size;
+	uint64_t memory_size;
+} BmFileHeader;
 
 #define INST_NOP() \
 	{ .type = inst_type_nop }
@@ -95,15 +239,68 @@ typedef struct {
 	{ .type = inst_type_eq }
 #define INST_DUP(ofs) \
 	{ .type = inst_type_dup, .operand = (ofs) }
+#define INST_READ8() \
+	{ .type = inst_type_read8 }
+#define INST_READ16() \
+	{ .type = inst_type_read16 }
+#define INST_READ32() \
+	{ .type = inst_type_read32 }
+#define INST_READ64() \
+	{ .type = inst_type_read64 }
+#define INST_WRITE8() \
+	{ .type = inst_type_write8 }
+#define INST_WRITE16() \
+	{ .type = inst_type_write16 }
+#define INST_WRITE32() \
+	{ .type = inst_type_write32 }
+#define INST_WRITE64() \
+	{ .type = inst_type_write64 }
+#define INST_VPLUS(lanes) \
+	{ .type = inst_type_vplus, .operand = (lanes) }
+#define INST_VMULT(lanes) \
+	{ .type = inst_type_vmult, .operand = (lanes) }
+#define INST_VEQ(lanes) \
+	{ .type = inst_type_veq, .operand = (lanes) }
+#define INST_VSUM(lanes) \
+	{ .type = inst_type_vsum, .operand = (lanes) }
+#define INST_NATIVE(index) \
+	{ .type = inst_type_native, .operand = (index) }
+#define INST_MVPLUS(lanes) \
+	{ .type = inst_type_mvplus, .operand = (lanes) }
+#define INST_MVMULT(lanes) \
+	{ .type = inst_type_mvmult, .operand = (lanes) }
+#define INST_MVEQ(lanes) \
+	{ .type = inst_type_mveq, .operand = (lanes) }
+#define INST_MVSUM(lanes) \
+	{ .type = inst_type_mvsum, .operand = (lanes) }
+
+// Lane-wise `dst[i] = dst[i] op src[i]` for `n` lanes.
+typedef void (*BmVectorBinop)(Word* dst, const Word* src, size_t n);
+// Horizontal reduction of `n` lanes.
+typedef Word (*BmVectorReduce)(const Word* src, size_t n);
+
+typedef struct {
+	const char* name;
+	BmVectorBinop plus;
+	BmVectorBinop mult;
+	BmVectorBinop eq;
+	BmVectorReduce sum;
+} BmVectorOps;
 
 typedef struct {
 	size_t count;
 	const char* data;
 } StringView;
 
+typedef enum {
+	label_kind_code,
+	label_kind_data,
+} LabelKind;
+
 typedef struct {
 	StringView name;
 	Word addr;
+	LabelKind kind;
 } Label;
 
 typedef struct {
@@ -116,28 +313,107 @@ typedef struct {
 	size_t labels_size;
 	DeferredOperand deferred_operands[DEFERRED_OPERANDS_CAPACITY];
 	size_t deferred_operands_size;
+	// Labels exported with `%global`, only meaningful for objects.
+	StringView globals[LABEL_CAPACITY];
+	size_t globals_size;
+	// Source being translated, errors are reported against it.
+	const char* file_path;
 } BasmContext;
 
+typedef enum {
+	// Operand is an address in the object's own code or data and gets shifted by the address the
+	// object is linked at.
+	relocation_kind_code,
+	relocation_kind_data,
+	// Operand is the address of a symbol exported by another object.
+	relocation_kind_symbol,
+} RelocationKind;
+
+typedef struct {
+	char name[BM_SYMBOL_NAME_CAPACITY];
+	Word addr;
+	uint32_t kind;
+} BmSymbol;
+
+typedef struct {
+	Word inst;
+	uint32_t kind;
+	char symbol[BM_SYMBOL_NAME_CAPACITY];
+} BmRelocation;
+
+// Everything a `.bmo` carries besides the program, natives and data already held by a `Bm`.
+typedef struct {
+	BmSymbol symbols[BM_SYMBOLS_CAPACITY];
+	size_t symbols_size;
+	BmRelocation relocations[BM_PROGRAM_CAPACITY];
+	size_t relocations_size;
+} BmObject;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t program_size;
+	uint64_t natives_size;
+	uint64_t memory_size;
+	uint64_t symbols_size;
+	uint64_t relocations_size;
+} BmObjectHeader;
+
 const char* trap_as_cstr(Trap trap);
 const char* inst_type_as_cstr(InstType type);
+size_t inst_type_memory_width(InstType type);
+uint8_t* bm_memory(Bm* bm);
+const BmVectorOps* bm_vector_ops(void);
+Word* bm_memory_vector(Bm* bm, Word addr, Word lanes);
 Trap bm_execute_inst(Bm* bm);
+bool bm_trace_stack_effect(Inst inst, bool taken, size_t* needed, Word* delta);
+void bm_trace_step(Bm* bm, Inst inst, Word ip, size_t stack_size);
+Trap bm_execute_trace(Bm* bm, const BmTrace* trace, int* limit);
 Trap bm_execute_program(Bm* bm, int limit);
+uint64_t bm_zigzag(int64_t value);
+int64_t bm_unzigzag(uint64_t value);
+uint64_t bm_program_hash(const Bm* bm);
+void bm_recorder_push(BmRecorder* recorder, uint64_t value);
+void bm_record_native_call(Bm* bm);
+void bm_record_native_return(Bm* bm);
+void bm_record_native(Bm* bm);
+void bm_record_step(Bm* bm, Word ip);
+void bm_record_trace(Bm* bm, uint64_t executed);
+void bm_record_finish(Bm* bm, Trap trap);
+size_t bm_recorder_drain(BmRecorder* recorder, FILE* stream);
+bool bm_record_read(StringView* record, uint64_t* value);
 void bm_dump(const Bm* bm, FILE* stream);
 void bm_load_program_from_memory(Bm* bm, Inst* program, Word program_size);
+char* bm_temporary_path(const char* file_path);
+void bm_commit_temporary(FILE* f, const char* temporary_path, const char* file_path);
 void bm_save_program_to_file(const Bm* bm, const char* file_path);
 void bm_load_program_from_file(Bm* bm, const char* file_path);
+void bm_save_object_to_file(const Bm* bm, const BmObject* object, const char* file_path);
+void bm_load_object_from_file(Bm* bm, BmObject* object, const char* file_path);
+Word bm_native_index(Bm* bm, StringView name, const char* file_path);
+void bm_bind_natives(Bm* bm, const BmNativeDef* defs, size_t defs_size);
 StringView cstr_as_sv(const char* cstr);
 StringView sv_trim_left(StringView sv);
 StringView sv_trim_right(StringView sv);
 StringView sv_trim(StringView sv);
 StringView sv_chop_by_delim(StringView* sv, char delim);
 bool sv_eq(StringView a, StringView b);
+bool sv_is_int(StringView sv);
 int sv_to_int(StringView sv);
+int basm_parse_int(const BasmContext* basm, StringView sv);
+bool basm_is_numeric_operand(StringView operand);
+void basm_copy_name(const char* file_path, StringView name, char* dst, size_t capacity);
+void basm_translate_lines(StringView source, Bm* bm, BasmContext* basm);
 void bm_translate_source(StringView source, Bm* bm, BasmContext* basm);
+void basm_translate_object(StringView source, Bm* bm, BasmContext* basm, BmObject* object);
+const Label* basm_find_label(const BasmContext* basm, StringView name);
 Word basm_find_label_addr(const BasmContext* basm, StringView name);
-void basm_push_label(BasmContext* basm, StringView name, Word addr);
+void basm_push_label(BasmContext* basm, StringView name, Word addr, LabelKind kind);
 void basm_push_deferred_operand(BasmContext* basm, StringView label, Word addr);
+void basm_push_data(const char* file_path, Bm* bm, const void* data, size_t size);
+void basm_translate_directive(StringView directive, StringView line, Bm* bm, BasmContext* basm);
 StringView slurp_file(const char* file_path);
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size);
 
 #endif
 
@@ -167,6 +443,253 @@ const char* inst_type_as_cstr(InstType type) {
 	}
 }
 
+size_t inst_type_memory_width(InstType type) {
+	switch (type) {
+		case inst_type_read8:
+		case inst_type_write8:
+			return 1;
+		case inst_type_read16:
+		case inst_type_write16:
+			return 2;
+		case inst_type_read32:
+		case inst_type_write32:
+			return 4;
+		case inst_type_read64:
+		case inst_type_write64:
+			return 8;
+		case inst_type_nop:
+		case inst_type_push:
+		case inst_type_plus:
+		case inst_type_minus:
+		case inst_type_mult:
+		case inst_type_div:
+		case inst_type_jump:
+		case inst_type_jump_if:
+		case inst_type_eq:
+		case inst_type_halt:
+		case inst_type_print_debug:
+		case inst_type_dup:
+		case inst_type_vplus:
+		case inst_type_vmult:
+		case inst_type_veq:
+		case inst_type_vsum:
+		case inst_type_native:
+		case inst_type_mvplus:
+		case inst_type_mvmult:
+		case inst_type_mveq:
+		case inst_type_mvsum:
+			return 0;
+		default:
+			assert(false && "unreachable");
+	}
+}
+
+uint8_t* bm_memory(Bm* bm) {
+	if (bm->memory == NULL) {
+		// Only the address space is reserved up front; the kernel backs pages on first touch,
+		// so the arena grows with the highest address the program actually uses.
+		void* memory = mmap(NULL, BM_MEMORY_CAPACITY, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (memory == MAP_FAILED) {
+			fprintf(stderr, "ERROR: Could not map memory: %s\n", strerror(errno));
+			exit(1);
+		}
+		bm->memory = memory;
+	}
+	return bm->memory;
+}
+
+static void bm_vector_plus_scalar(Word* dst, const Word* src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] += src[i];
+	}
+}
+
+static void bm_vector_mult_scalar(Word* dst, const Word* src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] *= src[i];
+	}
+}
+
+static void bm_vector_eq_scalar(Word* dst, const Word* src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = dst[i] == src[i];
+	}
+}
+
+static Word bm_vector_sum_scalar(const Word* src, size_t n) {
+	Word result = 0;
+	for (size_t i = 0; i < n; i++) {
+		result += src[i];
+	}
+	return result;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so these need no runtime check. It has no 64-bit compare, `eq` needs
+// SSE4.1 for that.
+static void bm_vector_plus_sse2(Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi64(a, b));
+	}
+	bm_vector_plus_scalar(dst + i, src + i, n - i);
+}
+
+static void bm_vector_mult_sse2(Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		// Same 32x32->64 decomposition as `bm_vector_mult_avx2`.
+		__m128i a_hi = _mm_srli_epi64(a, 32);
+		__m128i b_hi = _mm_srli_epi64(b, 32);
+		__m128i lo = _mm_mul_epu32(a, b);
+		__m128i cross = _mm_add_epi64(_mm_mul_epu32(a_hi, b), _mm_mul_epu32(a, b_hi));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi64(lo, _mm_slli_epi64(cross, 32)));
+	}
+	bm_vector_mult_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static void bm_vector_eq_sse41(
+		Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	__m128i one = _mm_set1_epi64x(1);
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(_mm_cmpeq_epi64(a, b), one));
+	}
+	bm_vector_eq_scalar(dst + i, src + i, n - i);
+}
+
+static Word bm_vector_sum_sse2(const Word* src, size_t n) {
+	size_t i = 0;
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2) {
+		acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(src + i)));
+	}
+	Word lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	return lanes[0] + lanes[1] + bm_vector_sum_scalar(src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bm_vector_plus_avx2(
+		Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi64(a, b));
+	}
+	bm_vector_plus_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bm_vector_mult_avx2(
+		Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+		// AVX2 has no 64-bit low multiply, so build it from 32x32->64 products:
+		// lo(a)*lo(b) + ((hi(a)*lo(b) + lo(a)*hi(b)) << 32)
+		__m256i a_hi = _mm256_srli_epi64(a, 32);
+		__m256i b_hi = _mm256_srli_epi64(b, 32);
+		__m256i lo = _mm256_mul_epu32(a, b);
+		__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(a_hi, b), _mm256_mul_epu32(a, b_hi));
+		__m256i result = _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+		_mm256_storeu_si256((__m256i*)(dst + i), result);
+	}
+	bm_vector_mult_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bm_vector_eq_avx2(
+		Word* dst, const Word* src, size_t n) {
+	size_t i = 0;
+	__m256i one = _mm256_set1_epi64x(1);
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_and_si256(_mm256_cmpeq_epi64(a, b), one));
+	}
+	bm_vector_eq_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static Word bm_vector_sum_avx2(const Word* src, size_t n) {
+	size_t i = 0;
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(src + i)));
+	}
+	Word lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + bm_vector_sum_scalar(src + i, n - i);
+}
+#endif
+
+static const BmVectorOps bm_vector_ops_scalar = {
+		.name = "scalar",
+		.plus = bm_vector_plus_scalar,
+		.mult = bm_vector_mult_scalar,
+		.eq = bm_vector_eq_scalar,
+		.sum = bm_vector_sum_scalar,
+};
+#if defined(__x86_64__)
+static const BmVectorOps bm_vector_ops_sse2 = {
+		.name = "sse2",
+		.plus = bm_vector_plus_sse2,
+		.mult = bm_vector_mult_sse2,
+		.eq = bm_vector_eq_scalar,
+		.sum = bm_vector_sum_sse2,
+};
+static const BmVectorOps bm_vector_ops_sse41 = {
+		.name = "sse4.1",
+		.plus = bm_vector_plus_sse2,
+		.mult = bm_vector_mult_sse2,
+		.eq = bm_vector_eq_sse41,
+		.sum = bm_vector_sum_sse2,
+};
+static const BmVectorOps bm_vector_ops_avx2 = {
+		.name = "avx2",
+		.plus = bm_vector_plus_avx2,
+		.mult = bm_vector_mult_avx2,
+		.eq = bm_vector_eq_avx2,
+		.sum = bm_vector_sum_avx2,
+};
+#endif
+
+static const BmVectorOps* bm_vector_ops_selected = &bm_vector_ops_scalar;
+
+// Runs before `main`, so VM threads only ever read the selection.
+__attribute__((constructor)) static void bm_vector_ops_select(void) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	bm_vector_ops_selected = &bm_vector_ops_sse2;
+	if (__builtin_cpu_supports("sse4.1")) {
+		bm_vector_ops_selected = &bm_vector_ops_sse41;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		bm_vector_ops_selected = &bm_vector_ops_avx2;
+	}
+#endif
+}
+
+const BmVectorOps* bm_vector_ops(void) {
+	return bm_vector_ops_selected;
+}
+
+// Returns the `lanes` words at `addr`, or NULL if they are not all inside the memory. The address
+// has to be aligned to a word, so the kernels can treat the memory as a `Word` array.
+Word* bm_memory_vector(Bm* bm, Word addr, Word lanes) {
+	if (addr < 0 || addr % sizeof(Word) != 0 ||
+			(uint64_t)lanes > (BM_MEMORY_CAPACITY - (uint64_t)addr) / sizeof(Word)) {
+		return NULL;
+	}
+	return (Word*)(bm_memory(bm) + addr);
+}
+
 Trap bm_execute_inst(Bm* bm) {
 	if (bm->ip >= bm->program_size) {
 		return trap_illegal_inst_access;
@@ -266,18 +789,411 @@ Trap bm_execute_inst(Bm* bm) {
 			bm->stack_size++;
 			bm->ip++;
 			break;
+		case inst_type_read8:
+		case inst_type_read16:
+		case inst_type_read32:
+		case inst_type_read64: {
+			if (bm->stack_size < 1) {
+				return trap_stack_underflow;
+			}
+			size_t width = inst_type_memory_width(inst.type);
+			Word addr = bm->stack[bm->stack_size - 1];
+			if (addr < 0 || (uint64_t)addr > BM_MEMORY_CAPACITY - width) {
+				return trap_illegal_memory_access;
+			}
+			uint64_t value = 0;
+			memcpy(&value, bm_memory(bm) + addr, width);
+			bm->stack[bm->stack_size - 1] = (Word)value;
+			bm->ip++;
+		} break;
+		case inst_type_write8:
+		case inst_type_write16:
+		case inst_type_write32:
+		case inst_type_write64: {
+			if (bm->stack_size < 2) {
+				return trap_stack_underflow;
+			}
+			size_t width = inst_type_memory_width(inst.type);
+			Word addr = bm->stack[bm->stack_size - 2];
+			if (addr < 0 || (uint64_t)addr > BM_MEMORY_CAPACITY - width) {
+				return trap_illegal_memory_access;
+			}
+			uint64_t value = (uint64_t)bm->stack[bm->stack_size - 1];
+			memcpy(bm_memory(bm) + addr, &value, width);
+			bm->stack_size -= 2;
+			bm->ip++;
+		} break;
+		case inst_type_vplus:
+		case inst_type_vmult:
+		case inst_type_veq: {
+			if (inst.operand <= 0) {
+				return trap_illegal_operand;
+			}
+			if (inst.operand > (Word)bm->stack_size / 2) {
+				return trap_stack_underflow;
+			}
+			const BmVectorOps* ops = bm_vector_ops();
+			BmVectorBinop op = ops->eq;
+			if (inst.type == inst_type_vplus) {
+				op = ops->plus;
+			} else if (inst.type == inst_type_vmult) {
+				op = ops->mult;
+			}
+			Word* rhs = &bm->stack[bm->stack_size - inst.operand];
+			op(rhs - inst.operand, rhs, inst.operand);
+			bm->stack_size -= inst.operand;
+			bm->ip++;
+		} break;
+		case inst_type_vsum:
+			if (inst.operand <= 0) {
+				return trap_illegal_operand;
+			}
+			if ((Word)bm->stack_size < inst.operand) {
+				return trap_stack_underflow;
+			}
+			bm->stack_size -= inst.operand;
+			bm->stack[bm->stack_size] =
+					bm_vector_ops()->sum(&bm->stack[bm->stack_size], inst.operand);
+			bm->stack_size++;
+			bm->ip++;
+			break;
+		case inst_type_native: {
+			if (inst.operand < 0 || (size_t)inst.operand >= bm->natives_size ||
+					bm->natives[inst.operand] == NULL) {
+				return trap_illegal_operand;
+			}
+			if (bm->recorder != NULL) {
+				bm_record_native_call(bm);
+			}
+			Trap trap = bm->natives[inst.operand](bm);
+			if (bm->recorder != NULL) {
+				bm_record_native_return(bm);
+			}
+			if (trap != trap_ok) {
+				return trap;
+			}
+			bm->ip++;
+		} break;
+		case inst_type_mvplus:
+		case inst_type_mvmult:
+		case inst_type_mveq: {
+			if (inst.operand <= 0) {
+				return trap_illegal_operand;
+			}
+			if (bm->stack_size < 2) {
+				return trap_stack_underflow;
+			}
+			Word* dst = bm_memory_vector(bm, bm->stack[bm->stack_size - 2], inst.operand);
+			Word* src = bm_memory_vector(bm, bm->stack[bm->stack_size - 1], inst.operand);
+			if (dst == NULL || src == NULL) {
+				return trap_illegal_memory_access;
+			}
+			// Partially overlapping vectors see lanes the same call already wrote, which only the
+			// scalar kernel does in a well-defined order on every host.
+			bool overlapping = dst != src && dst < src + inst.operand && src < dst + inst.operand;
+			const BmVectorOps* ops = bm_vector_ops();
+			BmVectorBinop op = overlapping ? bm_vector_eq_scalar : ops->eq;
+			if (inst.type == inst_type_mvplus) {
+				op = overlapping ? bm_vector_plus_scalar : ops->plus;
+			} else if (inst.type == inst_type_mvmult) {
+				op = overlapping ? bm_vector_mult_scalar : ops->mult;
+			}
+			op(dst, src, inst.operand);
+			bm->stack_size -= 2;
+			bm->ip++;
+		} break;
+		case inst_type_mvsum: {
+			if (inst.operand <= 0) {
+				return trap_illegal_operand;
+			}
+			if (bm->stack_size < 1) {
+				return trap_stack_underflow;
+			}
+			Word* src = bm_memory_vector(bm, bm->stack[bm->stack_size - 1], inst.operand);
+			if (src == NULL) {
+				return trap_illegal_memory_access;
+			}
+			bm->stack[bm->stack_size - 1] = bm_vector_ops()->sum(src, inst.operand);
+			bm->ip++;
+		} break;
 		default:
 			return trap_illegal_inst;
 	}
 	return trap_ok;
 }
 
+bool bm_trace_stack_effect(Inst inst, bool taken, size_t* needed, Word* delta) {
+	switch (inst.type) {
+		case inst_type_nop:
+		case inst_type_jump:
+			*needed = 0;
+			*delta = 0;
+			return true;
+		case inst_type_push:
+			*needed = 0;
+			*delta = 1;
+			return true;
+		case inst_type_plus:
+		case inst_type_minus:
+		case inst_type_mult:
+		case inst_type_div:
+		case inst_type_eq:
+			*needed = 2;
+			*delta = -1;
+			return true;
+		case inst_type_jump_if:
+			*needed = 1;
+			*delta = taken ? -1 : 0;
+			return true;
+		case inst_type_print_debug:
+			*needed = 1;
+			*delta = -1;
+			return true;
+		case inst_type_dup:
+			if (inst.operand < 0) {
+				return false;
+			}
+			*needed = inst.operand + 1;
+			*delta = 1;
+			return true;
+		case inst_type_read8:
+		case inst_type_read16:
+		case inst_type_read32:
+		case inst_type_read64:
+			*needed = 1;
+			*delta = 0;
+			return true;
+		case inst_type_write8:
+		case inst_type_write16:
+		case inst_type_write32:
+		case inst_type_write64:
+		case inst_type_mvplus:
+		case inst_type_mvmult:
+		case inst_type_mveq:
+			*needed = 2;
+			*delta = -2;
+			return true;
+		case inst_type_mvsum:
+			*needed = 1;
+			*delta = 0;
+			return true;
+		case inst_type_vplus:
+		case inst_type_vmult:
+		case inst_type_veq:
+			if (inst.operand <= 0 || inst.operand > BM_STACK_CAPACITY) {
+				return false;
+			}
+			*needed = 2 * inst.operand;
+			*delta = -inst.operand;
+			return true;
+		case inst_type_vsum:
+			if (inst.operand <= 0 || inst.operand > BM_STACK_CAPACITY) {
+				return false;
+			}
+			*needed = inst.operand;
+			*delta = 1 - inst.operand;
+			return true;
+		case inst_type_halt:
+		case inst_type_native:
+			return false;
+		default:
+			assert(false && "unreachable");
+	}
+}
+
+static void bm_trace_abort(Bm* bm) {
+	bm->trace_of[bm->recording->start] = -1;
+	bm->recording = NULL;
+}
+
+static void bm_trace_finish(Bm* bm) {
+	BmTrace* trace = bm->recording;
+	Word depth = 0;
+	Word lowest = 0;
+	Word highest = 0;
+	for (size_t i = 0; i < trace->ops_size; i++) {
+		size_t needed;
+		Word delta;
+		bm_trace_stack_effect(trace->ops[i].inst, trace->ops[i].taken, &needed, &delta);
+		if (depth - (Word)needed < lowest) {
+			lowest = depth - (Word)needed;
+		}
+		depth += delta;
+		if (depth > highest) {
+			highest = depth;
+		}
+	}
+	trace->stack_needed = -lowest;
+	trace->stack_growth = highest;
+
+	bm->trace_of[trace->start] = (int)bm->traces_size + 1;
+	bm->traces_size++;
+	bm->recording = NULL;
+}
+
+// Called after `inst` at `ip` executed successfully, with `stack_size` as it was before.
+void bm_trace_step(Bm* bm, Inst inst, Word ip, size_t stack_size) {
+	if (bm->recording != NULL) {
+		BmTrace* trace = bm->recording;
+		size_t needed;
+		Word delta;
+		bool taken = inst.type == inst_type_jump_if && bm->stack_size < stack_size;
+		if (trace->ops_size >= BM_TRACE_CAPACITY ||
+				!bm_trace_stack_effect(inst, taken, &needed, &delta)) {
+			bm_trace_abort(bm);
+			return;
+		}
+		trace->ops[trace->ops_size++] = (BmTraceOp){.inst = inst, .ip = ip, .taken = taken};
+		if (bm->ip == trace->start) {
+			bm_trace_finish(bm);
+		}
+		return;
+	}
+
+	if ((inst.type == inst_type_jump || inst.type == inst_type_jump_if) && bm->ip <= ip &&
+			bm->ip >= 0 && bm->trace_of[bm->ip] == 0 && bm->traces_size < BM_TRACES_CAPACITY) {
+		bm->branch_counts[bm->ip]++;
+		if (bm->branch_counts[bm->ip] >= BM_TRACE_THRESHOLD) {
+			bm->recording = &bm->traces[bm->traces_size];
+			bm->recording->start = bm->ip;
+			bm->recording->ops_size = 0;
+		}
+	}
+}
+
+// Runs whole iterations of `trace` while they fit into `limit` and the stack. Returns with `ip`
+// at the start of the trace, or at the instruction of a side exit or a trap.
+Trap bm_execute_trace(Bm* bm, const BmTrace* trace, int* limit) {
+	while ((*limit < 0 || (size_t)*limit >= trace->ops_size) &&
+			bm->stack_size >= trace->stack_needed &&
+			bm->stack_size + trace->stack_growth <= BM_STACK_CAPACITY) {
+		for (size_t i = 0; i < trace->ops_size; i++) {
+			const BmTraceOp* op = &trace->ops[i];
+			Word* stack = bm->stack;
+			size_t n = bm->stack_size;
+			bool leave = false;
+			Trap trap = trap_ok;
+			switch (op->inst.type) {
+				case inst_type_nop:
+				case inst_type_jump:
+					break;
+				case inst_type_push:
+					stack[n] = op->inst.operand;
+					bm->stack_size++;
+					break;
+				case inst_type_plus:
+					stack[n - 2] += stack[n - 1];
+					bm->stack_size--;
+					break;
+				case inst_type_minus:
+					stack[n - 2] -= stack[n - 1];
+					bm->stack_size--;
+					break;
+				case inst_type_mult:
+					stack[n - 2] *= stack[n - 1];
+					bm->stack_size--;
+					break;
+				case inst_type_eq:
+					stack[n - 2] = stack[n - 2] == stack[n - 1];
+					bm->stack_size--;
+					break;
+				case inst_type_dup:
+					stack[n] = stack[n - 1 - op->inst.operand];
+					bm->stack_size++;
+					break;
+				case inst_type_jump_if:
+					if ((stack[n - 1] != 0) != op->taken) {
+						bm->ip = op->ip;
+						leave = true;
+						break;
+					}
+					if (op->taken) {
+						bm->stack_size--;
+					}
+					break;
+				case inst_type_div:
+				case inst_type_print_debug:
+				case inst_type_read8:
+				case inst_type_read16:
+				case inst_type_read32:
+				case inst_type_read64:
+				case inst_type_write8:
+				case inst_type_write16:
+				case inst_type_write32:
+				case inst_type_write64:
+				case inst_type_mvplus:
+				case inst_type_mvmult:
+				case inst_type_mveq:
+				case inst_type_mvsum:
+				case inst_type_vplus:
+				case inst_type_vmult:
+				case inst_type_veq:
+				case inst_type_vsum:
+					// These can trap or have side effects, so they take the checked path.
+					bm->ip = op->ip;
+					trap = bm_execute_inst(bm);
+					leave = trap != trap_ok;
+					break;
+				case inst_type_halt:
+				case inst_type_native:
+				default:
+					assert(false && "unreachable");
+			}
+
+			if (leave) {
+				bm->executed += i;
+				if (*limit > 0) {
+					*limit -= (int)i;
+				}
+				return trap;
+			}
+		}
+
+		bm->ip = trace->start;
+		bm->executed += trace->ops_size;
+		if (*limit > 0) {
+			*limit -= (int)trace->ops_size;
+		}
+	}
+
+	return trap_ok;
+}
+
+// Besides interpreting, this counts taken backward branches. Once a loop head gets hot, one
+// iteration is recorded into a trace, and later arrivals at the head run the trace instead.
 Trap bm_execute_program(Bm* bm, int limit) {
 	while (limit != 0 && !bm->halt) {
+		if (!bm->traces_disabled && bm->recording == NULL && bm->ip >= 0 &&
+				bm->ip < bm->program_size && bm->trace_of[bm->ip] > 0) {
+			uint64_t executed = bm->executed;
+			Trap trap = bm_execute_trace(bm, &bm->traces[bm->trace_of[bm->ip] - 1], &limit);
+			if (bm->recorder != NULL && bm->executed > executed) {
+				bm_record_trace(bm, bm->executed - executed);
+			}
+			if (trap != trap_ok) {
+				return trap;
+			}
+			if (limit == 0) {
+				break;
+			}
+		}
+
+		Word ip = bm->ip;
+		size_t stack_size = bm->stack_size;
 		Trap trap = bm_execute_inst(bm);
 		if (trap != trap_ok) {
+			if (bm->recording != NULL) {
+				bm_trace_abort(bm);
+			}
 			return trap;
 		}
+		bm->executed++;
+		if (bm->recorder != NULL) {
+			bm_record_step(bm, ip);
+		}
+		if (!bm->traces_disabled) {
+			bm_trace_step(bm, bm->program[ip], ip, stack_size);
+		}
 
 		if (limit > 0) {
 			limit--;
@@ -287,6 +1203,168 @@ Trap bm_execute_program(Bm* bm, int limit) {
 	return trap_ok;
 }
 
+uint64_t bm_zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t bm_unzigzag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Hash of everything the execution of a freshly loaded program depends on: its instructions,
+// the natives it calls and its initial data. Call it before running the program.
+uint64_t bm_program_hash(const Bm* bm) {
+	uint64_t hash = FNV1A_OFFSET_BASIS;
+	uint64_t program_size = bm->program_size;
+	hash = fnv1a(hash, &program_size, sizeof(program_size));
+	for (Word i = 0; i < bm->program_size; i++) {
+		// Field by field, the padding of `Inst` is not part of the program.
+		uint32_t type = bm->program[i].type;
+		hash = fnv1a(hash, &type, sizeof(type));
+		hash = fnv1a(hash, &bm->program[i].operand, sizeof(bm->program[i].operand));
+	}
+	uint64_t natives_size = bm->natives_size;
+	hash = fnv1a(hash, &natives_size, sizeof(natives_size));
+	for (size_t i = 0; i < bm->natives_size; i++) {
+		hash = fnv1a(hash, bm->native_names[i], strlen(bm->native_names[i]) + 1);
+	}
+	uint64_t memory_size = bm->memory_size;
+	hash = fnv1a(hash, &memory_size, sizeof(memory_size));
+	if (bm->memory_size > 0) {
+		hash = fnv1a(hash, bm->memory, bm->memory_size);
+	}
+	return hash;
+}
+
+// Appends `value` as a LEB128 varint, waiting for the flusher when the ring is full.
+void bm_recorder_push(BmRecorder* recorder, uint64_t value) {
+	size_t head = atomic_load_explicit(&recorder->head, memory_order_relaxed);
+	do {
+		while (head - atomic_load_explicit(&recorder->tail, memory_order_acquire) >=
+				BM_RECORDER_CAPACITY) {
+			sched_yield();
+		}
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		if (value != 0) {
+			byte |= 0x80;
+		}
+		recorder->data[head % BM_RECORDER_CAPACITY] = byte;
+		head++;
+	} while (value != 0);
+	atomic_store_explicit(&recorder->head, head, memory_order_release);
+}
+
+// Natives must not write memory, see `BmNative`, and while recording they cannot.
+static void bm_protect_memory(Bm* bm, int prot) {
+	if (mprotect(bm_memory(bm), BM_MEMORY_CAPACITY, prot) != 0) {
+		fprintf(stderr, "ERROR: Could not protect memory: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+// Called right before a `native` is called.
+void bm_record_native_call(Bm* bm) {
+	BmRecorder* recorder = bm->recorder;
+	memcpy(recorder->stack, bm->stack, bm->stack_size * sizeof(bm->stack[0]));
+	recorder->stack_size = bm->stack_size;
+	recorder->native_called = true;
+	bm_protect_memory(bm, PROT_READ);
+}
+
+// Called right after a `native` returned, whether it trapped or not.
+void bm_record_native_return(Bm* bm) {
+	bm_protect_memory(bm, PROT_READ | PROT_WRITE);
+}
+
+// Records the stack effect of the `native` that just returned: the new stack size, the index of
+// the lowest word it changed and the words from there to the top, zigzag encoded.
+void bm_record_native(Bm* bm) {
+	BmRecorder* recorder = bm->recorder;
+	size_t low = 0;
+	while (low < recorder->stack_size && low < bm->stack_size &&
+			recorder->stack[low] == bm->stack[low]) {
+		low++;
+	}
+	bm_recorder_push(recorder, bm->stack_size);
+	bm_recorder_push(recorder, low);
+	for (size_t i = low; i < bm->stack_size; i++) {
+		bm_recorder_push(recorder, bm_zigzag(bm->stack[i]));
+	}
+	recorder->native_called = false;
+}
+
+// Called after the instruction at `ip` executed.
+void bm_record_step(Bm* bm, Word ip) {
+	BmRecorder* recorder = bm->recorder;
+	recorder->run++;
+	if (bm->ip != ip + 1) {
+		bm_recorder_push(recorder, recorder->run);
+		bm_recorder_push(recorder, bm_zigzag(bm->ip - ip - 1) << 1);
+		recorder->run = 0;
+	} else if (recorder->native_called) {
+		bm_recorder_push(recorder, recorder->run);
+		bm_recorder_push(recorder, 1);
+		bm_record_native(bm);
+		recorder->run = 0;
+	}
+}
+
+// Called after `bm_execute_trace` ran `executed` instructions. Traces are deterministic, so only
+// their length and the `ip` they left at are recorded.
+void bm_record_trace(Bm* bm, uint64_t executed) {
+	BmRecorder* recorder = bm->recorder;
+	bm_recorder_push(recorder, recorder->run);
+	bm_recorder_push(recorder, (executed << 1) | 1);
+	bm_recorder_push(recorder, bm_zigzag(bm->ip));
+	recorder->run = 0;
+}
+
+void bm_record_finish(Bm* bm, Trap trap) {
+	BmRecorder* recorder = bm->recorder;
+	bm_recorder_push(recorder, recorder->run);
+	bm_recorder_push(recorder, 0);
+	bm_recorder_push(recorder, trap);
+	bm_recorder_push(recorder, recorder->native_called);
+	if (recorder->native_called) {
+		bm_record_native(bm);
+	}
+	recorder->run = 0;
+	atomic_store_explicit(&recorder->done, true, memory_order_release);
+}
+
+// Writes whatever the VM thread has recorded so far to `stream`, returns the number of bytes.
+size_t bm_recorder_drain(BmRecorder* recorder, FILE* stream) {
+	size_t tail = atomic_load_explicit(&recorder->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&recorder->head, memory_order_acquire);
+	size_t drained = head - tail;
+	while (tail != head) {
+		size_t begin = tail % BM_RECORDER_CAPACITY;
+		size_t count = head - tail;
+		if (count > BM_RECORDER_CAPACITY - begin) {
+			count = BM_RECORDER_CAPACITY - begin;
+		}
+		fwrite(recorder->data + begin, 1, count, stream);
+		tail += count;
+	}
+	atomic_store_explicit(&recorder->tail, tail, memory_order_release);
+	return drained;
+}
+
+bool bm_record_read(StringView* record, uint64_t* value) {
+	*value = 0;
+	for (unsigned shift = 0; record->count > 0 && shift < 64; shift += 7) {
+		uint8_t byte = (uint8_t)record->data[0];
+		record->data++;
+		record->count--;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 void bm_dump(const Bm* bm, FILE* stream) {
 	fprintf(stream, "Stack:\n");
 	if (bm->stack_size > 0) {
@@ -304,59 +1382,281 @@ void bm_load_program_from_memory(Bm* bm, Inst* program, Word program_size) {
 	bm->program_size = program_size;
 }
 
+// A unique path next to `file_path` to write its new contents to, see `bm_commit_temporary`.
+char* bm_temporary_path(const char* file_path) {
+	static atomic_size_t temporaries = 0;
+	size_t n = strlen(file_path) + 64;
+	char* result = malloc(n);
+	if (result == NULL) {
+		fprintf(stderr, "ERROR: Could not allocate memory for path: %s\n", strerror(errno));
+		exit(1);
+	}
+	snprintf(result, n, "%s.%ld.%zu.tmp", file_path, (long)getpid(),
+			atomic_fetch_add(&temporaries, 1));
+	return result;
+}
+
+// Closes `f`, written to `temporary_path`, and renames it over `file_path`. Other processes and
+// hard links to the old `file_path` never see a partially written file.
+void bm_commit_temporary(FILE* f, const char* temporary_path, const char* file_path) {
+	if (ferror(f) || fclose(f) != 0) {
+		fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n", file_path, strerror(errno));
+		remove(temporary_path);
+		exit(1);
+	}
+	if (rename(temporary_path, file_path) < 0) {
+		fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n", file_path, strerror(errno));
+		remove(temporary_path);
+		exit(1);
+	}
+}
+
 void bm_save_program_to_file(const Bm* bm, const char* file_path) {
-	FILE* f = fopen(file_path, "wb");
+	char* temporary_path = bm_temporary_path(file_path);
+	FILE* f = fopen(temporary_path, "wb");
 	if (f == NULL) {
-		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", file_path, strerror(errno));
+		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", temporary_path,
+				strerror(errno));
 		exit(1);
 	}
 
+	BmFileHeader header = {
+			.magic = BM_FILE_MAGIC,
+			.version = BM_FILE_VERSION,
+			.program_size = bm->program_size,
+			.natives_size = bm->natives_size,
+			.memory_size = bm->memory_size,
+	};
+	fwrite(&header, sizeof(header), 1, f);
 	fwrite(bm->program, sizeof(Inst), bm->program_size, f);
+	fwrite(bm->native_names, sizeof(bm->native_names[0]), bm->natives_size, f);
+	if (bm->memory_size > 0) {
+		fwrite(bm->memory, 1, bm->memory_size, f);
+	}
+
+	bm_commit_temporary(f, temporary_path, file_path);
+	free(temporary_path);
+}
+
+void bm_load_program_from_file(Bm* bm, const char* file_path) {
+	FILE* f = fopen(file_path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+
+	BmFileHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1) {
+		fprintf(stderr, "ERROR: Could not read header of file `%s`\n", file_path);
+		exit(1);
+	}
+
+	if (header.magic != BM_FILE_MAGIC) {
+		fprintf(stderr, "ERROR: `%s` is not a BM program: unexpected magic 0x%04" PRIX32 "\n",
+				file_path, header.magic);
+		exit(1);
+	}
+
+	if (header.version != BM_FILE_VERSION) {
+		fprintf(stderr, "ERROR: `%s` has unsupported version %" PRIu32 ", expected %d\n",
+				file_path, header.version, BM_FILE_VERSION);
+		exit(1);
+	}
+
+	if (header.program_size > BM_PROGRAM_CAPACITY) {
+		fprintf(stderr, "ERROR: `%s` has too many instructions: %" PRIu64 " > %d\n", file_path,
+				header.program_size, BM_PROGRAM_CAPACITY);
+		exit(1);
+	}
+
+	if (header.natives_size > BM_NATIVES_CAPACITY) {
+		fprintf(stderr, "ERROR: `%s` references too many natives: %" PRIu64 " > %d\n", file_path,
+				header.natives_size, BM_NATIVES_CAPACITY);
+		exit(1);
+	}
+
+	if (header.memory_size > BM_MEMORY_CAPACITY) {
+		fprintf(stderr, "ERROR: `%s` has too much static data: %" PRIu64 " > %d\n", file_path,
+				header.memory_size, BM_MEMORY_CAPACITY);
+		exit(1);
+	}
+
+	bm->program_size = (Word)fread(bm->program, sizeof(bm->program[0]), header.program_size, f);
+	bm->natives_size =
+			fread(bm->native_names, sizeof(bm->native_names[0]), header.natives_size, f);
+	if (header.memory_size > 0) {
+		bm->memory_size = (Word)fread(bm_memory(bm), 1, header.memory_size, f);
+	}
+
 	if (ferror(f)) {
-		fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n", file_path, strerror(errno));
+		fprintf(stderr, "ERROR: Could not read file `%s`: %s\n", file_path, strerror(errno));
+		exit(1);
+	}
+
+	if ((uint64_t)bm->program_size != header.program_size ||
+			(uint64_t)bm->natives_size != header.natives_size ||
+			(uint64_t)bm->memory_size != header.memory_size) {
+		fprintf(stderr, "ERROR: `%s` is truncated\n", file_path);
 		exit(1);
 	}
 
+	for (size_t i = 0; i < bm->natives_size; i++) {
+		if (memchr(bm->native_names[i], '\0', BM_NATIVE_NAME_CAPACITY) == NULL) {
+			fprintf(stderr, "ERROR: `%s` has an unterminated native name\n", file_path);
+			exit(1);
+		}
+	}
+
 	fclose(f);
 }
 
-void bm_load_program_from_file(Bm* bm, const char* file_path) {
+void bm_save_object_to_file(const Bm* bm, const BmObject* object, const char* file_path) {
+	char* temporary_path = bm_temporary_path(file_path);
+	FILE* f = fopen(temporary_path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", temporary_path,
+				strerror(errno));
+		exit(1);
+	}
+
+	BmObjectHeader header = {
+			.magic = BM_OBJECT_MAGIC,
+			.version = BM_OBJECT_VERSION,
+			.program_size = bm->program_size,
+			.natives_size = bm->natives_size,
+			.memory_size = bm->memory_size,
+			.symbols_size = object->symbols_size,
+			.relocations_size = object->relocations_size,
+	};
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(bm->program, sizeof(Inst), bm->program_size, f);
+	fwrite(bm->native_names, sizeof(bm->native_names[0]), bm->natives_size, f);
+	if (bm->memory_size > 0) {
+		fwrite(bm->memory, 1, bm->memory_size, f);
+	}
+	fwrite(object->symbols, sizeof(object->symbols[0]), object->symbols_size, f);
+	fwrite(object->relocations, sizeof(object->relocations[0]), object->relocations_size, f);
+
+	bm_commit_temporary(f, temporary_path, file_path);
+	free(temporary_path);
+}
+
+void bm_load_object_from_file(Bm* bm, BmObject* object, const char* file_path) {
 	FILE* f = fopen(file_path, "rb");
 	if (f == NULL) {
 		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", file_path, strerror(errno));
 		exit(1);
 	}
 
-	if (fseek(f, 0, SEEK_END) < 0) {
-		fprintf(stderr, "ERROR: Could not read file `%s`: %s\n", file_path, strerror(errno));
+	BmObjectHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1) {
+		fprintf(stderr, "ERROR: Could not read header of file `%s`\n", file_path);
 		exit(1);
 	}
 
-	long m = ftell(f);
-	if (m < 0) {
-		fprintf(stderr, "ERROR: Could not read file `%s`: %s\n", file_path, strerror(errno));
+	if (header.magic != BM_OBJECT_MAGIC) {
+		fprintf(stderr, "ERROR: `%s` is not a BM object: unexpected magic 0x%04" PRIX32 "\n",
+				file_path, header.magic);
 		exit(1);
 	}
 
-	assert(m % sizeof(bm->program[0]) == 0);
-	assert((size_t)m <= BM_PROGRAM_CAPACITY * sizeof(bm->program[0]));
+	if (header.version != BM_OBJECT_VERSION) {
+		fprintf(stderr, "ERROR: `%s` has unsupported version %" PRIu32 ", expected %d\n",
+				file_path, header.version, BM_OBJECT_VERSION);
+		exit(1);
+	}
 
-	if (fseek(f, 0, SEEK_SET) < 0) {
-		fprintf(stderr, "ERROR: Could not read file `%s`: %s\n", file_path, strerror(errno));
+	if (header.program_size > BM_PROGRAM_CAPACITY || header.natives_size > BM_NATIVES_CAPACITY ||
+			header.memory_size > BM_MEMORY_CAPACITY || header.symbols_size > BM_SYMBOLS_CAPACITY ||
+			header.relocations_size > BM_PROGRAM_CAPACITY) {
+		fprintf(stderr, "ERROR: `%s` exceeds the capacity of the virtual machine\n", file_path);
 		exit(1);
 	}
 
-	bm->program_size =
-			(Word)fread(bm->program, sizeof(bm->program[0]), m / sizeof(bm->program[0]), f);
+	bm->program_size = (Word)fread(bm->program, sizeof(bm->program[0]), header.program_size, f);
+	bm->natives_size =
+			fread(bm->native_names, sizeof(bm->native_names[0]), header.natives_size, f);
+	bm->memory_size = 0;
+	if (header.memory_size > 0) {
+		bm->memory_size = (Word)fread(bm_memory(bm), 1, header.memory_size, f);
+	}
+	object->symbols_size =
+			fread(object->symbols, sizeof(object->symbols[0]), header.symbols_size, f);
+	object->relocations_size = fread(
+			object->relocations, sizeof(object->relocations[0]), header.relocations_size, f);
 
 	if (ferror(f)) {
 		fprintf(stderr, "ERROR: Could not read file `%s`: %s\n", file_path, strerror(errno));
 		exit(1);
 	}
 
+	if ((uint64_t)bm->program_size != header.program_size ||
+			(uint64_t)bm->natives_size != header.natives_size ||
+			(uint64_t)bm->memory_size != header.memory_size ||
+			(uint64_t)object->symbols_size != header.symbols_size ||
+			(uint64_t)object->relocations_size != header.relocations_size) {
+		fprintf(stderr, "ERROR: `%s` is truncated\n", file_path);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < bm->natives_size; i++) {
+		if (memchr(bm->native_names[i], '\0', BM_NATIVE_NAME_CAPACITY) == NULL) {
+			fprintf(stderr, "ERROR: `%s` has an unterminated native name\n", file_path);
+			exit(1);
+		}
+	}
+
+	for (size_t i = 0; i < object->symbols_size; i++) {
+		if (memchr(object->symbols[i].name, '\0', BM_SYMBOL_NAME_CAPACITY) == NULL) {
+			fprintf(stderr, "ERROR: `%s` has an unterminated symbol name\n", file_path);
+			exit(1);
+		}
+	}
+	for (size_t i = 0; i < object->relocations_size; i++) {
+		if (memchr(object->relocations[i].symbol, '\0', BM_SYMBOL_NAME_CAPACITY) == NULL) {
+			fprintf(stderr, "ERROR: `%s` has an unterminated symbol name\n", file_path);
+			exit(1);
+		}
+	}
+
 	fclose(f);
 }
 
+// `file_path` is the source or object `name` comes from, for errors.
+Word bm_native_index(Bm* bm, StringView name, const char* file_path) {
+	for (size_t i = 0; i < bm->natives_size; i++) {
+		if (sv_eq(cstr_as_sv(bm->native_names[i]), name)) {
+			return (Word)i;
+		}
+	}
+
+	if (bm->natives_size >= BM_NATIVES_CAPACITY) {
+		fprintf(stderr, "ERROR: %s: native `%.*s` exceeds the capacity of %d distinct natives\n",
+				file_path, (int)name.count, name.data, BM_NATIVES_CAPACITY);
+		exit(1);
+	}
+	basm_copy_name(
+			file_path, name, bm->native_names[bm->natives_size], BM_NATIVE_NAME_CAPACITY);
+	return (Word)bm->natives_size++;
+}
+
+void bm_bind_natives(Bm* bm, const BmNativeDef* defs, size_t defs_size) {
+	for (size_t i = 0; i < bm->natives_size; i++) {
+		bm->natives[i] = NULL;
+		for (size_t j = 0; j < defs_size; j++) {
+			if (strcmp(bm->native_names[i], defs[j].name) == 0) {
+				bm->natives[i] = defs[j].native;
+				break;
+			}
+		}
+		if (bm->natives[i] == NULL) {
+			fprintf(stderr, "ERROR: native `%s` is not provided by the host\n",
+					bm->native_names[i]);
+			exit(1);
+		}
+	}
+}
+
 StringView cstr_as_sv(const char* cstr) {
 	return (StringView){
 			.count = strlen(cstr),
@@ -416,30 +1716,86 @@ bool sv_eq(StringView a, StringView b) {
 	return a.count == 0 || memcmp(a.data, b.data, a.count) == 0;
 }
 
+// An optional `-` followed by at least one digit and nothing else.
+bool sv_is_int(StringView sv) {
+	size_t i = 0;
+	if (i < sv.count && sv.data[i] == '-') {
+		i++;
+	}
+	if (i == sv.count) {
+		return false;
+	}
+	for (; i < sv.count; i++) {
+		if (!isdigit(sv.data[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
 int sv_to_int(StringView sv) {
+	int sign = 1;
+	size_t i = 0;
+	if (i < sv.count && sv.data[i] == '-') {
+		sign = -1;
+		i++;
+	}
 	int result = 0;
-	for (size_t i = 0; i < sv.count && isdigit(sv.data[i]); i++) {
+	for (; i < sv.count && isdigit(sv.data[i]); i++) {
 		result = result * 10 + sv.data[i] - '0';
 	}
-	return result;
+	return sign * result;
 }
 
-Word basm_find_label_addr(const BasmContext* basm, StringView name) {
+int basm_parse_int(const BasmContext* basm, StringView sv) {
+	if (!sv_is_int(sv)) {
+		fprintf(stderr, "ERROR: %s: invalid number `%.*s`\n", basm->file_path, (int)sv.count,
+				sv.data);
+		exit(1);
+	}
+	return sv_to_int(sv);
+}
+
+// Whether a `push` or jump operand is meant as a number rather than a label.
+bool basm_is_numeric_operand(StringView operand) {
+	return operand.count > 0 && (isdigit(operand.data[0]) || operand.data[0] == '-');
+}
+
+const Label* basm_find_label(const BasmContext* basm, StringView name) {
 	for (size_t i = 0; i < basm->labels_size; i++) {
 		if (sv_eq(basm->labels[i].name, name)) {
-			return basm->labels[i].addr;
+			return &basm->labels[i];
 		}
 	}
-	fprintf(stderr, "ERROR: label `%.*s` does not exist\n", (int)name.count, name.data);
-	exit(1);
+	return NULL;
+}
+
+Word basm_find_label_addr(const BasmContext* basm, StringView name) {
+	const Label* label = basm_find_label(basm, name);
+	if (label == NULL) {
+		fprintf(stderr, "ERROR: %s: label `%.*s` does not exist\n", basm->file_path,
+				(int)name.count, name.data);
+		exit(1);
+	}
+	return label->addr;
 }
 
-void basm_push_label(BasmContext* basm, StringView name, Word addr) {
+void basm_push_label(BasmContext* basm, StringView name, Word addr, LabelKind kind) {
 	assert(basm->labels_size < LABEL_CAPACITY);
-	basm->labels[basm->labels_size++] = (Label){.name = name, .addr = addr};
+	basm->labels[basm->labels_size++] = (Label){.name = name, .addr = addr, .kind = kind};
 }
 
-void bm_translate_source(StringView source, Bm* bm, BasmContext* basm) {
+void basm_copy_name(const char* file_path, StringView name, char* dst, size_t capacity) {
+	if (name.count >= capacity) {
+		fprintf(stderr, "ERROR: %s: name `%.*s` is too long\n", file_path, (int)name.count,
+				name.data);
+		exit(1);
+	}
+	memcpy(dst, name.data, name.count);
+	dst[name.count] = '\0';
+}
+
+void basm_translate_lines(StringView source, Bm* bm, BasmContext* basm) {
 	while (source.count > 0) {
 		assert(bm->program_size < BM_PROGRAM_CAPACITY);
 		StringView line = sv_trim(sv_chop_by_delim(&source, '\n'));
@@ -451,41 +1807,105 @@ void bm_translate_source(StringView source, Bm* bm, BasmContext* basm) {
 						.count = inst_name.count - 1,
 						.data = inst_name.data,
 				};
-				basm_push_label(basm, label, bm->program_size);
+				basm_push_label(basm, label, bm->program_size, label_kind_code);
 				inst_name = sv_trim(sv_chop_by_delim(&line, ' '));
 			}
 
-			if (inst_name.count > 0) {
+			if (inst_name.count > 0 && inst_name.data[0] == '%') {
+				basm_translate_directive(inst_name, line, bm, basm);
+			} else if (inst_name.count > 0) {
 				StringView operand = sv_trim(sv_chop_by_delim(&line, '#'));
 
 				if (sv_eq(inst_name, cstr_as_sv("nop"))) {
 					bm->program[bm->program_size++] = (Inst){.type = inst_type_nop};
 				} else if (sv_eq(inst_name, cstr_as_sv("push"))) {
+					Word value = 0;
+					if (basm_is_numeric_operand(operand)) {
+						value = basm_parse_int(basm, operand);
+					} else if (operand.count > 0) {
+						basm_push_deferred_operand(basm, operand, bm->program_size);
+					}
 					bm->program[bm->program_size++] =
-							(Inst){.type = inst_type_push, .operand = sv_to_int(operand)};
+							(Inst){.type = inst_type_push, .operand = value};
 				} else if (sv_eq(inst_name, cstr_as_sv("dup"))) {
 					bm->program[bm->program_size++] =
 							(Inst){.type = inst_type_dup, .operand = sv_to_int(operand)};
 				} else if (sv_eq(inst_name, cstr_as_sv("plus"))) {
 					bm->program[bm->program_size++] = (Inst){.type = inst_type_plus};
-				} else if (sv_eq(inst_name, cstr_as_sv("jmp"))) {
-					if (operand.count > 0 && isdigit(operand.data[0])) {
+				} else if (sv_eq(inst_name, cstr_as_sv("halt"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_halt};
+				} else if (sv_eq(inst_name, cstr_as_sv("jmp")) ||
+						sv_eq(inst_name, cstr_as_sv("jmp_if"))) {
+					InstType type = inst_type_jump_if;
+					if (sv_eq(inst_name, cstr_as_sv("jmp"))) {
+						type = inst_type_jump;
+					}
+					if (basm_is_numeric_operand(operand)) {
 						bm->program[bm->program_size++] = (Inst){
-								.type = inst_type_jump,
-								.operand = sv_to_int(operand),
+								.type = type,
+								.operand = basm_parse_int(basm, operand),
 						};
 					} else {
 						basm_push_deferred_operand(basm, operand, bm->program_size);
-						bm->program[bm->program_size++] = (Inst){.type = inst_type_jump};
+						bm->program[bm->program_size++] = (Inst){.type = type};
 					}
+				} else if (sv_eq(inst_name, cstr_as_sv("read8"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_read8};
+				} else if (sv_eq(inst_name, cstr_as_sv("read16"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_read16};
+				} else if (sv_eq(inst_name, cstr_as_sv("read32"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_read32};
+				} else if (sv_eq(inst_name, cstr_as_sv("read64"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_read64};
+				} else if (sv_eq(inst_name, cstr_as_sv("write8"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_write8};
+				} else if (sv_eq(inst_name, cstr_as_sv("write16"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_write16};
+				} else if (sv_eq(inst_name, cstr_as_sv("write32"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_write32};
+				} else if (sv_eq(inst_name, cstr_as_sv("write64"))) {
+					bm->program[bm->program_size++] = (Inst){.type = inst_type_write64};
+				} else if (sv_eq(inst_name, cstr_as_sv("vplus"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_vplus, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("vmult"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_vmult, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("veq"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_veq, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("vsum"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_vsum, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("mvplus"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_mvplus, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("mvmult"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_mvmult, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("mveq"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_mveq, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("mvsum"))) {
+					bm->program[bm->program_size++] =
+							(Inst){.type = inst_type_mvsum, .operand = sv_to_int(operand)};
+				} else if (sv_eq(inst_name, cstr_as_sv("native"))) {
+					bm->program[bm->program_size++] = (Inst){
+							.type = inst_type_native,
+							.operand = bm_native_index(bm, operand, basm->file_path),
+					};
 				} else {
-					fprintf(stderr, "ERROR: unknown instruction `%.*s`\n", (int)inst_name.count,
-							inst_name.data);
+					fprintf(stderr, "ERROR: %s: unknown instruction `%.*s`\n", basm->file_path,
+							(int)inst_name.count, inst_name.data);
 					exit(1);
 				}
 			}
 		}
 	}
+}
+
+void bm_translate_source(StringView source, Bm* bm, BasmContext* basm) {
+	basm_translate_lines(source, bm, basm);
 	bm->program[bm->program_size++] = (Inst){.type = inst_type_halt};
 
 	for (size_t i = 0; i < basm->deferred_operands_size; i++) {
@@ -494,12 +1914,125 @@ void bm_translate_source(StringView source, Bm* bm, BasmContext* basm) {
 	}
 }
 
+// Like `bm_translate_source`, but leaves the program open for `bmld`: no `halt` is appended,
+// labels the source does not define become symbol relocations, and every jump and label operand
+// records how it has to be shifted when the object is placed into the final program.
+void basm_translate_object(StringView source, Bm* bm, BasmContext* basm, BmObject* object) {
+	basm_translate_lines(source, bm, basm);
+
+	bool relocated[BM_PROGRAM_CAPACITY] = {0};
+	for (size_t i = 0; i < basm->deferred_operands_size; i++) {
+		const DeferredOperand* deferred = &basm->deferred_operands[i];
+		BmRelocation* relocation = &object->relocations[object->relocations_size++];
+		const Label* label = basm_find_label(basm, deferred->label);
+		relocation->inst = deferred->addr;
+		if (label == NULL) {
+			relocation->kind = relocation_kind_symbol;
+			basm_copy_name(basm->file_path, deferred->label, relocation->symbol,
+					BM_SYMBOL_NAME_CAPACITY);
+		} else if (label->kind == label_kind_data) {
+			relocation->kind = relocation_kind_data;
+			bm->program[deferred->addr].operand = label->addr;
+		} else {
+			relocation->kind = relocation_kind_code;
+			bm->program[deferred->addr].operand = label->addr;
+		}
+		relocated[deferred->addr] = true;
+	}
+
+	for (Word i = 0; i < bm->program_size; i++) {
+		InstType type = bm->program[i].type;
+		if ((type == inst_type_jump || type == inst_type_jump_if) && !relocated[i]) {
+			object->relocations[object->relocations_size++] = (BmRelocation){
+					.inst = i,
+					.kind = relocation_kind_code,
+			};
+		}
+	}
+
+	for (size_t i = 0; i < basm->globals_size; i++) {
+		const Label* label = basm_find_label(basm, basm->globals[i]);
+		if (label == NULL) {
+			fprintf(stderr, "ERROR: %s: global `%.*s` is not defined\n", basm->file_path,
+					(int)basm->globals[i].count, basm->globals[i].data);
+			exit(1);
+		}
+		assert(object->symbols_size < BM_SYMBOLS_CAPACITY);
+		BmSymbol* symbol = &object->symbols[object->symbols_size++];
+		basm_copy_name(basm->file_path, label->name, symbol->name, BM_SYMBOL_NAME_CAPACITY);
+		symbol->addr = label->addr;
+		symbol->kind = label->kind;
+	}
+}
+
 void basm_push_deferred_operand(BasmContext* basm, StringView label, Word addr) {
 	assert(basm->deferred_operands_size < DEFERRED_OPERANDS_CAPACITY);
 	basm->deferred_operands[basm->deferred_operands_size++] =
 			(DeferredOperand){.addr = addr, .label = label};
 }
 
+void basm_push_data(const char* file_path, Bm* bm, const void* data, size_t size) {
+	if ((size_t)bm->memory_size + size > BM_MEMORY_CAPACITY) {
+		fprintf(stderr, "ERROR: %s: static data exceeds memory capacity of %d bytes\n",
+				file_path, BM_MEMORY_CAPACITY);
+		exit(1);
+	}
+	memcpy(bm_memory(bm) + bm->memory_size, data, size);
+	bm->memory_size += size;
+}
+
+void basm_translate_directive(StringView directive, StringView line, Bm* bm, BasmContext* basm) {
+	StringView name = sv_trim(sv_chop_by_delim(&line, ' '));
+	line = sv_trim(line);
+	if (name.count == 0) {
+		fprintf(stderr, "ERROR: %s: directive `%.*s` expects a name\n", basm->file_path,
+				(int)directive.count, directive.data);
+		exit(1);
+	}
+
+	if (sv_eq(directive, cstr_as_sv("%global"))) {
+		assert(basm->globals_size < LABEL_CAPACITY);
+		basm->globals[basm->globals_size++] = name;
+		return;
+	}
+
+	basm_push_label(basm, name, bm->memory_size, label_kind_data);
+
+	if (sv_eq(directive, cstr_as_sv("%string"))) {
+		if (line.count < 2 || line.data[0] != '"') {
+			fprintf(stderr, "ERROR: %s: `%%string %.*s` expects a quoted string\n",
+					basm->file_path, (int)name.count, name.data);
+			exit(1);
+		}
+		const char* end = memchr(line.data + 1, '"', line.count - 1);
+		if (end == NULL) {
+			fprintf(stderr, "ERROR: %s: `%%string %.*s` is missing a closing quote\n",
+					basm->file_path, (int)name.count, name.data);
+			exit(1);
+		}
+		basm_push_data(basm->file_path, bm, line.data + 1, end - line.data - 1);
+	} else if (sv_eq(directive, cstr_as_sv("%bytes"))) {
+		line = sv_trim(sv_chop_by_delim(&line, '#'));
+		while (line.count > 0) {
+			StringView byte = sv_chop_by_delim(&line, ' ');
+			line = sv_trim_left(line);
+			if (!sv_is_int(byte) || byte.count > 3 || sv_to_int(byte) < 0 ||
+					sv_to_int(byte) > UINT8_MAX) {
+				fprintf(stderr, "ERROR: %s: `%%bytes %.*s` has invalid byte `%.*s`\n",
+						basm->file_path, (int)name.count, name.data, (int)byte.count,
+						byte.data);
+				exit(1);
+			}
+			uint8_t value = (uint8_t)sv_to_int(byte);
+			basm_push_data(basm->file_path, bm, &value, 1);
+		}
+	} else {
+		fprintf(stderr, "ERROR: %s: unknown directive `%.*s`\n", basm->file_path,
+				(int)directive.count, directive.data);
+		exit(1);
+	}
+}
+
 StringView slurp_file(const char* file_path) {
 	FILE* f = fopen(file_path, "r");
 	if (f == NULL) {
@@ -539,4 +2072,14 @@ StringView slurp_file(const char* file_path) {
 	return (StringView){.count = m, .data = buffer};
 }
 
+// Continues an FNV-1a hash, start with `FNV1A_OFFSET_BASIS`.
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
 #endif
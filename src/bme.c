@@ -1,7 +1,404 @@
 #define BM_IMPLEMENTATION
 #include "bm.h"
 
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 static Bm bm = {0};
+static BmRecorder recorder = {0};
+static FILE* record_file = NULL;
+
+// Pops a byte count and an address, checking that the region lies inside memory.
+static Trap pop_memory_region(Bm* bm, uint8_t** data, size_t* count) {
+	if (bm->stack_size < 2) {
+		return trap_stack_underflow;
+	}
+	Word addr = bm->stack[bm->stack_size - 2];
+	Word size = bm->stack[bm->stack_size - 1];
+	if (addr < 0 || size < 0 || (uint64_t)size > BM_MEMORY_CAPACITY ||
+			(uint64_t)addr > BM_MEMORY_CAPACITY - (uint64_t)size) {
+		return trap_illegal_memory_access;
+	}
+	bm->stack_size -= 2;
+	*data = bm_memory(bm) + addr;
+	*count = (size_t)size;
+	return trap_ok;
+}
+
+static Trap native_write(Bm* bm) {
+	uint8_t* data;
+	size_t count;
+	Trap trap = pop_memory_region(bm, &data, &count);
+	if (trap != trap_ok) {
+		return trap;
+	}
+	fwrite(data, 1, count, stdout);
+	return trap_ok;
+}
+
+static Trap native_fnv1a(Bm* bm) {
+	uint8_t* data;
+	size_t count;
+	Trap trap = pop_memory_region(bm, &data, &count);
+	if (trap != trap_ok) {
+		return trap;
+	}
+	bm->stack[bm->stack_size++] = (Word)fnv1a(FNV1A_OFFSET_BASIS, data, count);
+	return trap_ok;
+}
+
+static const BmNativeDef natives[] = {
+		{.name = "write", .native = native_write},
+		{.name = "fnv1a", .native = native_fnv1a},
+};
+
+typedef struct {
+	const char* name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+	// Opened on its own because it could not join the group of `counters[0]`.
+	bool standalone;
+	uint64_t value;
+	uint64_t time_enabled;
+	uint64_t time_running;
+} Counter;
+
+#define HW_CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static Counter counters[] = {
+		{.name = "cycles", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES},
+		{.name = "instructions", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_INSTRUCTIONS},
+		{.name = "branch-misses", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_BRANCH_MISSES},
+		{.name = "L1i-misses", .type = PERF_TYPE_HW_CACHE,
+				.config = HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1I)},
+		{.name = "L1d-misses", .type = PERF_TYPE_HW_CACHE,
+				.config = HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+};
+
+#define COUNTER_CYCLES 0
+
+static int counter_open(Counter* counter, int group_fd) {
+	struct perf_event_attr attr = {0};
+	attr.size = sizeof(attr);
+	attr.type = counter->type;
+	attr.config = counter->config;
+	// Members of a group run whenever their leader does.
+	attr.disabled = group_fd < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// All counters are opened as one group led by cycles, so the PMU schedules them together and
+// ratios between them are measured over the same interval. A counter that cannot join the group
+// is opened on its own, and if the PMU multiplexes it its value is scaled up to an estimate.
+// Counters the kernel refuses (no PMU, virtualized host, perf_event_paranoid) keep `fd == -1`
+// and are reported as unavailable instead of failing the run.
+static void counters_start(void) {
+	int leader = -1;
+	for (size_t i = 0; i < ARRAY_LEN(counters); i++) {
+		counters[i].standalone = leader < 0;
+		counters[i].fd = counter_open(&counters[i], leader);
+		if (counters[i].fd < 0 && leader >= 0) {
+			counters[i].standalone = true;
+			counters[i].fd = counter_open(&counters[i], -1);
+		} else if (counters[i].fd >= 0 && leader < 0) {
+			leader = counters[i].fd;
+		}
+	}
+	for (size_t i = 0; i < ARRAY_LEN(counters); i++) {
+		if (counters[i].fd >= 0 && counters[i].standalone) {
+			ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+	}
+}
+
+static void counters_stop(void) {
+	for (size_t i = 0; i < ARRAY_LEN(counters); i++) {
+		if (counters[i].fd >= 0 && counters[i].standalone) {
+			ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		}
+	}
+	for (size_t i = 0; i < ARRAY_LEN(counters); i++) {
+		if (counters[i].fd >= 0) {
+			uint64_t values[3];
+			if (read(counters[i].fd, values, sizeof(values)) == sizeof(values)) {
+				counters[i].value = values[0];
+				counters[i].time_enabled = values[1];
+				counters[i].time_running = values[2];
+			}
+			close(counters[i].fd);
+		}
+	}
+}
+
+// Whether the PMU only ran the counter for part of the time it was enabled.
+static bool counter_estimated(const Counter* counter) {
+	return counter->time_running < counter->time_enabled;
+}
+
+static double counter_value(const Counter* counter) {
+	if (counter_estimated(counter)) {
+		return (double)counter->value * (double)counter->time_enabled /
+				(double)counter->time_running;
+	}
+	return (double)counter->value;
+}
+
+static double seconds_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void print_stats(FILE* stream, const Bm* bm, double elapsed) {
+	fprintf(stream, "Stats:\n");
+	fprintf(stream, "    %-16s %" PRIu64 "\n", "vm-instructions", bm->executed);
+	fprintf(stream, "    %-16s %zu\n", "traces", bm->traces_size);
+	fprintf(stream, "    %-16s %.6f s\n", "elapsed", elapsed);
+	for (size_t i = 0; i < ARRAY_LEN(counters); i++) {
+		const Counter* counter = &counters[i];
+		if (counter->fd < 0) {
+			fprintf(stream, "    %-16s <not available>\n", counter->name);
+		} else if (counter->time_running == 0) {
+			fprintf(stream, "    %-16s <not counted>\n", counter->name);
+		} else if (counter_estimated(counter)) {
+			fprintf(stream, "    %-16s ~%.0f (estimated, counted %.1f%% of the time)\n",
+					counter->name, counter_value(counter),
+					100.0 * (double)counter->time_running / (double)counter->time_enabled);
+		} else {
+			fprintf(stream, "    %-16s %" PRIu64 "\n", counter->name, counter->value);
+		}
+	}
+	if (bm->executed > 0) {
+		const Counter* cycles = &counters[COUNTER_CYCLES];
+		if (cycles->fd >= 0 && cycles->time_running > 0) {
+			fprintf(stream, "    %-16s %s%.2f\n", "cycles/vm-inst",
+					counter_estimated(cycles) ? "~" : "",
+					counter_value(cycles) / (double)bm->executed);
+		}
+		fprintf(stream, "    %-16s %.2f\n", "ns/vm-inst", elapsed * 1e9 / (double)bm->executed);
+	}
+}
+
+static void* flush_record(void* arg) {
+	(void)arg;
+	for (;;) {
+		bool done = atomic_load_explicit(&recorder.done, memory_order_acquire);
+		size_t drained = bm_recorder_drain(&recorder, record_file);
+		if (done && drained == 0) {
+			break;
+		}
+		if (drained == 0) {
+			usleep(1000);
+		}
+	}
+	return NULL;
+}
+
+// Memory is read-only during a `native` call while recording, see `BmNative`. A fault inside it
+// is a native writing memory; anything else gets the default action.
+static void memory_fault(int signal, siginfo_t* info, void* context) {
+	(void)context;
+	uint8_t* addr = info->si_addr;
+	if (bm.memory != NULL && addr >= bm.memory && addr < bm.memory + BM_MEMORY_CAPACITY) {
+		static const char message[] = "ERROR: native wrote to memory while recording\n";
+		write(STDERR_FILENO, message, sizeof(message) - 1);
+		_exit(1);
+	}
+	struct sigaction action = {.sa_handler = SIG_DFL};
+	sigaction(signal, &action, NULL);
+}
+
+static Trap execute_recorded(const char* record_file_path, int limit) {
+	record_file = fopen(record_file_path, "wb");
+	if (record_file == NULL) {
+		fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", record_file_path,
+				strerror(errno));
+		exit(1);
+	}
+	BmRecordHeader header = {
+			.magic = BM_RECORD_MAGIC,
+			.version = BM_RECORD_VERSION,
+			.program_size = bm.program_size,
+			.program_hash = bm_program_hash(&bm),
+	};
+	fwrite(&header, sizeof(header), 1, record_file);
+
+	pthread_t flusher;
+	int error = pthread_create(&flusher, NULL, flush_record, NULL);
+	if (error != 0) {
+		fprintf(stderr, "ERROR: Could not start flusher thread: %s\n", strerror(error));
+		exit(1);
+	}
+
+	struct sigaction action = {.sa_sigaction = memory_fault, .sa_flags = SA_SIGINFO};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, NULL);
+
+	bm.recorder = &recorder;
+	Trap trap = bm_execute_program(&bm, limit);
+	bm_record_finish(&bm, trap);
+	pthread_join(flusher, NULL);
+
+	if (ferror(record_file)) {
+		fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n", record_file_path,
+				strerror(errno));
+		exit(1);
+	}
+	fclose(record_file);
+	return trap;
+}
+
+static void replay_diverged(uint64_t step) {
+	fprintf(stderr, "ERROR: replay diverged from the record at step %" PRIu64 ", ip %" PRI_WORD
+					"\n",
+			step, bm.ip);
+	exit(1);
+}
+
+static void replay_stop(uint64_t step, Trap trap) {
+	printf("Step %" PRIu64 ", ip %" PRI_WORD "\n", step, bm.ip);
+	bm_dump(&bm, stdout);
+	if (trap != trap_ok) {
+		fprintf(stderr, "ERROR: %s\n", trap_as_cstr(trap));
+	}
+	exit(0);
+}
+
+static void replay_truncated(const char* record_file_path) {
+	fprintf(stderr, "ERROR: `%s` is truncated\n", record_file_path);
+	exit(1);
+}
+
+// Applies the recorded stack effect of the `native` at `ip` instead of calling it.
+static void replay_native(const char* record_file_path, StringView* record, uint64_t step) {
+	if (bm.ip < 0 || bm.ip >= bm.program_size || bm.program[bm.ip].type != inst_type_native) {
+		replay_diverged(step);
+	}
+	uint64_t stack_size;
+	uint64_t low;
+	if (!bm_record_read(record, &stack_size) || !bm_record_read(record, &low)) {
+		replay_truncated(record_file_path);
+	}
+	if (stack_size > BM_STACK_CAPACITY || low > stack_size || low > bm.stack_size) {
+		replay_diverged(step);
+	}
+	for (uint64_t i = low; i < stack_size; i++) {
+		uint64_t word;
+		if (!bm_record_read(record, &word)) {
+			replay_truncated(record_file_path);
+		}
+		bm.stack[i] = bm_unzigzag(word);
+	}
+	bm.stack_size = stack_size;
+}
+
+// Re-executes the program instruction by instruction, checking every transition against the
+// record, or for trace runs only where they ended. Dumps the state after `step` instructions, or
+// at the end when `step` is negative. Natives are not called again, their recorded results are
+// used instead.
+static void replay(const char* record_file_path, int64_t step) {
+	StringView record = slurp_file(record_file_path);
+	BmRecordHeader header;
+	if (record.count < sizeof(header)) {
+		fprintf(stderr, "ERROR: Could not read header of file `%s`\n", record_file_path);
+		exit(1);
+	}
+	memcpy(&header, record.data, sizeof(header));
+	record.data += sizeof(header);
+	record.count -= sizeof(header);
+
+	if (header.magic != BM_RECORD_MAGIC || header.version != BM_RECORD_VERSION) {
+		fprintf(stderr, "ERROR: `%s` is not a BM execution record\n", record_file_path);
+		exit(1);
+	}
+	if (header.program_size != (uint64_t)bm.program_size ||
+			header.program_hash != bm_program_hash(&bm)) {
+		fprintf(stderr, "ERROR: `%s` was recorded for a different program\n", record_file_path);
+		exit(1);
+	}
+
+	uint64_t executed = 0;
+	for (;;) {
+		uint64_t run;
+		uint64_t kind;
+		if (!bm_record_read(&record, &run) || !bm_record_read(&record, &kind)) {
+			replay_truncated(record_file_path);
+		}
+		bool native = kind == 1;
+		bool trace = kind % 2 == 1 && kind > 1;
+		int64_t delta = trace ? 0 : bm_unzigzag(kind >> 1);
+
+		for (uint64_t i = 0; i < run; i++) {
+			if (step >= 0 && executed == (uint64_t)step) {
+				replay_stop(executed, trap_ok);
+			}
+			Word ip = bm.ip;
+			if (native && i + 1 == run) {
+				replay_native(record_file_path, &record, executed);
+				bm.ip++;
+			} else if (bm_execute_inst(&bm) != trap_ok) {
+				replay_diverged(executed);
+			}
+			executed++;
+			Word expected = ip + 1;
+			if (i + 1 == run) {
+				expected += delta;
+			}
+			if (bm.ip != expected) {
+				replay_diverged(executed);
+			}
+		}
+
+		if (trace) {
+			uint64_t trace_ip;
+			if (!bm_record_read(&record, &trace_ip)) {
+				replay_truncated(record_file_path);
+			}
+			for (uint64_t i = 0; i < kind >> 1; i++) {
+				if (step >= 0 && executed == (uint64_t)step) {
+					replay_stop(executed, trap_ok);
+				}
+				if (bm_execute_inst(&bm) != trap_ok) {
+					replay_diverged(executed);
+				}
+				executed++;
+			}
+			if (bm.ip != bm_unzigzag(trace_ip)) {
+				replay_diverged(executed);
+			}
+		}
+
+		if (kind == 0) {
+			uint64_t trap;
+			uint64_t native_trapped;
+			if (!bm_record_read(&record, &trap) || !bm_record_read(&record, &native_trapped)) {
+				replay_truncated(record_file_path);
+			}
+			if (step >= 0 && executed < (uint64_t)step) {
+				fprintf(stderr, "ERROR: `%s` only has %" PRIu64 " steps\n", record_file_path,
+						executed);
+				exit(1);
+			}
+			if (native_trapped) {
+				replay_native(record_file_path, &record, executed);
+			} else if (trap != trap_ok && bm_execute_inst(&bm) != (Trap)trap) {
+				replay_diverged(executed);
+			}
+			replay_stop(executed, (Trap)trap);
+		}
+	}
+}
 
 static char* shift(int* argc, char*** argv) {
 	if (*argc == 0) {
@@ -14,13 +411,18 @@ static char* shift(int* argc, char*** argv) {
 }
 
 static void usage(FILE* stream, const char* program) {
-	fprintf(stream, "Usage: %s -i <input.bm> [-l <limit>] [-h]\n", program);
+	fprintf(stream, "Usage: %s -i <input.bm> [-l <limit>] [--stats] [--no-traces]\n", program);
+	fprintf(stream, "           [--trace <record>] [--replay <record> [--step <n>]] [-h]\n");
 }
 
 int main(int argc, char** argv) {
 	const char* program = shift(&argc, &argv);
 	const char* input_file_path = NULL;
 	int limit = -1;
+	bool stats = false;
+	const char* record_file_path = NULL;
+	const char* replay_file_path = NULL;
+	int64_t step = -1;
 
 	while (argc > 0) {
 		const char* flag = shift(&argc, &argv);
@@ -41,6 +443,25 @@ int main(int argc, char** argv) {
 
 			errno = 0;
 			limit = atoi(shift(&argc, &argv));
+		} else if (strcmp(flag, "--trace") == 0 || strcmp(flag, "--replay") == 0 ||
+				strcmp(flag, "--step") == 0) {
+			if (argc == 0) {
+				usage(stderr, program);
+				fprintf(stderr, "ERROR: no argument provided for flag `%s`\n", flag);
+				exit(1);
+			}
+
+			if (strcmp(flag, "--trace") == 0) {
+				record_file_path = shift(&argc, &argv);
+			} else if (strcmp(flag, "--replay") == 0) {
+				replay_file_path = shift(&argc, &argv);
+			} else {
+				step = atoll(shift(&argc, &argv));
+			}
+		} else if (strcmp(flag, "--stats") == 0) {
+			stats = true;
+		} else if (strcmp(flag, "--no-traces") == 0) {
+			bm.traces_disabled = true;
 		} else if (strcmp(flag, "-h") == 0) {
 			usage(stdout, program);
 			exit(0);
@@ -60,7 +481,31 @@ int main(int argc, char** argv) {
 	}
 
 	bm_load_program_from_file(&bm, input_file_path);
-	Trap trap = bm_execute_program(&bm, limit);
+
+	// Replay leaves the natives unbound, so a `native` the record does not account for traps
+	// instead of being called again.
+	if (replay_file_path != NULL) {
+		replay(replay_file_path, step);
+	}
+	bm_bind_natives(&bm, natives, ARRAY_LEN(natives));
+
+	Trap trap;
+	if (stats) {
+		counters_start();
+		double start = seconds_now();
+		if (record_file_path != NULL) {
+			trap = execute_recorded(record_file_path, limit);
+		} else {
+			trap = bm_execute_program(&bm, limit);
+		}
+		double elapsed = seconds_now() - start;
+		counters_stop();
+		print_stats(stderr, &bm, elapsed);
+	} else if (record_file_path != NULL) {
+		trap = execute_recorded(record_file_path, limit);
+	} else {
+		trap = bm_execute_program(&bm, limit);
+	}
 	bm_dump(&bm, stdout);
 
 	if (trap != trap_ok) {
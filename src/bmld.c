@@ -0,0 +1,149 @@
+#define BM_IMPLEMENTATION
+#include "bm.h"
+
+static Bm output = {0};
+static Bm input = {0};
+static BmObject object = {0};
+
+// Exported symbols of all objects linked so far, with final addresses.
+static BmSymbol symbols[BM_SYMBOLS_CAPACITY];
+static size_t symbols_size = 0;
+
+// Symbol relocations, with `inst` already pointing into `output`.
+static BmRelocation pending[BM_PROGRAM_CAPACITY];
+static size_t pending_size = 0;
+
+static char* shift(int* argc, char*** argv) {
+	if (*argc == 0) {
+		return NULL;
+	}
+	char* arg = (*argv)[0];
+	(*argv)++;
+	(*argc)--;
+	return arg;
+}
+
+static void usage(FILE* stream, const char* program) {
+	fprintf(stream, "Usage: %s <output.bm> <input.bmo>...\n", program);
+}
+
+static const BmSymbol* find_symbol(const char* name) {
+	for (size_t i = 0; i < symbols_size; i++) {
+		if (strcmp(symbols[i].name, name) == 0) {
+			return &symbols[i];
+		}
+	}
+	return NULL;
+}
+
+static void link_object(const char* input_file_path) {
+	bm_load_object_from_file(&input, &object, input_file_path);
+
+	Word code_base = output.program_size;
+	Word data_base = output.memory_size;
+
+	// One slot stays free for the final `halt`.
+	if (code_base + input.program_size >= BM_PROGRAM_CAPACITY) {
+		fprintf(stderr, "ERROR: linking `%s` exceeds the program capacity of %d instructions\n",
+				input_file_path, BM_PROGRAM_CAPACITY);
+		exit(1);
+	}
+	if ((uint64_t)data_base + (uint64_t)input.memory_size > BM_MEMORY_CAPACITY) {
+		fprintf(stderr, "ERROR: linking `%s` exceeds the memory capacity of %d bytes\n",
+				input_file_path, BM_MEMORY_CAPACITY);
+		exit(1);
+	}
+
+	for (Word i = 0; i < input.program_size; i++) {
+		Inst inst = input.program[i];
+		if (inst.type == inst_type_native) {
+			if (inst.operand < 0 || (size_t)inst.operand >= input.natives_size) {
+				fprintf(stderr, "ERROR: `%s` calls an unknown native\n", input_file_path);
+				exit(1);
+			}
+			inst.operand = bm_native_index(
+					&output, cstr_as_sv(input.native_names[inst.operand]), input_file_path);
+		}
+		output.program[code_base + i] = inst;
+	}
+	output.program_size += input.program_size;
+
+	if (input.memory_size > 0) {
+		memcpy(bm_memory(&output) + data_base, input.memory, input.memory_size);
+		output.memory_size += input.memory_size;
+	}
+
+	for (size_t i = 0; i < object.symbols_size; i++) {
+		const BmSymbol* symbol = &object.symbols[i];
+		if (find_symbol(symbol->name) != NULL) {
+			fprintf(stderr, "ERROR: symbol `%s` from `%s` is already defined\n", symbol->name,
+					input_file_path);
+			exit(1);
+		}
+		assert(symbols_size < BM_SYMBOLS_CAPACITY);
+		symbols[symbols_size] = *symbol;
+		symbols[symbols_size].addr += symbol->kind == label_kind_data ? data_base : code_base;
+		symbols_size++;
+	}
+
+	for (size_t i = 0; i < object.relocations_size; i++) {
+		const BmRelocation* relocation = &object.relocations[i];
+		if (relocation->inst < 0 || relocation->inst >= input.program_size) {
+			fprintf(stderr, "ERROR: `%s` has a relocation outside of its program\n",
+					input_file_path);
+			exit(1);
+		}
+		Word inst = code_base + relocation->inst;
+		switch ((RelocationKind)relocation->kind) {
+			case relocation_kind_code:
+				output.program[inst].operand += code_base;
+				break;
+			case relocation_kind_data:
+				output.program[inst].operand += data_base;
+				break;
+			case relocation_kind_symbol:
+				assert(pending_size < BM_PROGRAM_CAPACITY);
+				pending[pending_size] = *relocation;
+				pending[pending_size].inst = inst;
+				pending_size++;
+				break;
+			default:
+				fprintf(stderr, "ERROR: `%s` has a relocation of unknown kind %" PRIu32 "\n",
+						input_file_path, relocation->kind);
+				exit(1);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* program = shift(&argc, &argv);
+
+	if (argc == 0) {
+		usage(stderr, program);
+		fprintf(stderr, "ERROR: expected output\n");
+		exit(1);
+	}
+	const char* output_file_path = shift(&argc, &argv);
+
+	if (argc == 0) {
+		usage(stderr, program);
+		fprintf(stderr, "ERROR: expected input\n");
+		exit(1);
+	}
+
+	while (argc > 0) {
+		link_object(shift(&argc, &argv));
+	}
+	output.program[output.program_size++] = (Inst){.type = inst_type_halt};
+
+	for (size_t i = 0; i < pending_size; i++) {
+		const BmSymbol* symbol = find_symbol(pending[i].symbol);
+		if (symbol == NULL) {
+			fprintf(stderr, "ERROR: undefined symbol `%s`\n", pending[i].symbol);
+			exit(1);
+		}
+		output.program[pending[i].inst].operand = symbol->addr;
+	}
+
+	bm_save_program_to_file(&output, output_file_path);
+}
@@ -14,6 +14,14 @@ int main(int argc, char** argv) {
 
 	bm_load_program_from_file(&bm, input_file_path);
 
+	if (bm.memory_size > 0) {
+		printf("%%bytes data");
+		for (Word i = 0; i < bm.memory_size; i++) {
+			printf(" %u", bm.memory[i]);
+		}
+		printf("\n");
+	}
+
 	for (Word i = 0; i < bm.program_size; i++) {
 		switch (bm.program[i].type) {
 			case inst_type_nop:
@@ -44,6 +52,10 @@ int main(int argc, char** argv) {
 				printf("eq\n");
 				break;
 			case inst_type_halt:
+				// basm and bmld end every program with a `halt` that is not in the source.
+				if (i + 1 < bm.program_size) {
+					printf("halt\n");
+				}
 				break;
 			case inst_type_print_debug:
 				printf("print_debug\n");
@@ -51,6 +63,62 @@ int main(int argc, char** argv) {
 			case inst_type_dup:
 				printf("dup %" PRI_WORD "\n", bm.program[i].operand);
 				break;
+			case inst_type_read8:
+				printf("read8\n");
+				break;
+			case inst_type_read16:
+				printf("read16\n");
+				break;
+			case inst_type_read32:
+				printf("read32\n");
+				break;
+			case inst_type_read64:
+				printf("read64\n");
+				break;
+			case inst_type_write8:
+				printf("write8\n");
+				break;
+			case inst_type_write16:
+				printf("write16\n");
+				break;
+			case inst_type_write32:
+				printf("write32\n");
+				break;
+			case inst_type_write64:
+				printf("write64\n");
+				break;
+			case inst_type_vplus:
+				printf("vplus %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_vmult:
+				printf("vmult %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_veq:
+				printf("veq %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_vsum:
+				printf("vsum %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_native:
+				if (bm.program[i].operand >= 0 &&
+						(size_t)bm.program[i].operand < bm.natives_size) {
+					printf("native %s\n", bm.native_names[bm.program[i].operand]);
+				} else {
+					printf("native %" PRI_WORD "\n", bm.program[i].operand);
+				}
+				break;
+			case inst_type_mvplus:
+				printf("mvplus %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_mvmult:
+				printf("mvmult %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_mveq:
+				printf("mveq %" PRI_WORD "\n", bm.program[i].operand);
+				break;
+			case inst_type_mvsum:
+				printf("mvsum %" PRI_WORD "\n", bm.program[i].operand);
+				break;
 		}
 	}
 }